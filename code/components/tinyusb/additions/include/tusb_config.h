@@ -89,11 +89,11 @@ extern "C" {
 // Enabled device class driver
 #define CFG_TUD_CDC                 CONFIG_TINYUSB_CDC_PORT_NUM
 #define CFG_TUD_MSC                 CONFIG_TINYUSB_MSC_ENABLED
-#define CFG_TUD_HID                 CONFIG_TINYUSB_HID_ENABLED
+#define CFG_TUD_HID                 (CONFIG_TINYUSB_HID_ENABLED * 2) // keyboard, pointer
 #define CFG_TUD_MIDI                CONFIG_TINYUSB_MIDI_ENABLED
 #define CFG_TUD_CUSTOM_CLASS        CONFIG_TINYUSB_CUSTOM_CLASS_ENABLED
 
-#define CFG_TUD_HID_EP_BUFSIZE 9
+#define CFG_TUD_HID_EP_BUFSIZE 16
 
 #ifdef __cplusplus
 }
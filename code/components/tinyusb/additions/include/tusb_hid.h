@@ -23,28 +23,96 @@ extern "C" {
 #include "tinyusb.h"
 
 
+#if CONFIG_TINYUSB_HID_MOUSE_XY_16BIT
+#define TINYUSB_HID_MOUSE_XY_MAX 32767
+#else
+#define TINYUSB_HID_MOUSE_XY_MAX 127
+#endif
+
+// How often the host polls the HID endpoints, at full speed
+#define TINYUSB_HID_POLL_INTERVAL_US (CONFIG_TINYUSB_HID_POLL_INTERVAL * 1000)
+
+/**
+ * Reports are queued by report ID and sent by the TinyUSB task in order, as
+ * fast as the host polls: keyboard on its boot protocol interface, consumer
+ * then mouse on the other one. None of these functions block.
+ *
+ * A report posted while the bus is suspended asks the host to resume, if it
+ * allows remote wakeup, and is sent once it has.
+ */
+
+typedef struct {
+    // by report ID - 1
+    uint32_t sent[3];      // reports sent
+    uint32_t failed[3];    // reports TinyUSB refused, kept queued and sent again after a backoff
+    uint32_t coalesced[3]; // out of slots, replaced the last one queued with the same keys
+    uint32_t full[3];      // out of slots with different keys, refused for the caller to retry
+    uint32_t dropped[3];   // states lost: mouse buttons merged while out of slots, or still
+                           // queued when the host went away
+    uint32_t wakeups;      // remote wakeups requested
+    uint32_t frames;       // start of frames seen, CONFIG_TINYUSB_HID_SOF_SYNC only
+    uint32_t mount_to_report_us; // from the last mount to the first report sent after it
+    // from posting a state to the host polling its report, keyboard then pointer interface
+    uint32_t polled[2];
+    uint64_t poll_delay_us_sum[2];
+    uint32_t poll_delay_us_max[2];
+} tinyusb_hid_stats_t;
+
 /**
  * @brief Report mouse movement and buttons.
+ * Motion is summed up with what is not sent yet as long as the buttons stay the same.
  * @param buttons hid mouse button bit mask
- * @param x Current delta x movement of the mouse
- * @param y Current delta y movement on the mouse
+ * @param x Current delta x movement of the mouse, clamped to TINYUSB_HID_MOUSE_XY_MAX
+ * @param y Current delta y movement on the mouse, clamped to TINYUSB_HID_MOUSE_XY_MAX
  * @param vertical Current delta wheel movement on the mouse
  * @param horizontal using AC Pan
  */
 void tinyusb_hid_mouse_report(
-  uint8_t buttons, int8_t x, int8_t y, int8_t vertical, int8_t horizontal);
+  uint8_t buttons, int16_t x, int16_t y, int8_t vertical, int8_t horizontal);
+
+/**
+ * @brief Get the resolution multiplier that the host has negotiated for the wheel and AC Pan.
+ * @return number of high-resolution units per detent, 1 if the host never set it
+ */
+uint8_t tinyusb_hid_resolution_multiplier(void);
 
 /**
  * @brief Report key press in the keyboard, using array here, contains six keys at most.
  * @param keycode hid keyboard code array
+ * @return false if out of slots, post the state again later
  */
-void tinyusb_hid_keyboard_report(uint8_t *keycode);
+bool tinyusb_hid_keyboard_report(uint8_t *keycode);
 
 /**
  * @brief Report multimedia keys.
  * @param keycode 2-byte multimedia keycode
+ * @return false if out of slots, post the state again later
+ */
+bool tinyusb_hid_consumer_report(uint16_t keycode);
+
+/**
+ * @brief Start timing the first report and set up the retry timers, call on mount.
+ */
+void tinyusb_hid_mount(void);
+
+/**
+ * @brief Send the reports queued while the bus was suspended, call on resume.
+ */
+void tinyusb_hid_resume(void);
+
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+/**
+ * @brief Called by the TinyUSB task on each start of frame, override to time the input to it.
+ * @param sof_us esp_timer time the SOF was handled, a bit after the frame started
+ */
+void tinyusb_hid_sof_cb(int64_t sof_us);
+#endif
+
+/**
+ * @brief Get the report scheduler counters.
+ * @param stats output
  */
-void tinyusb_hid_consumer_report(uint16_t keycode);
+void tinyusb_hid_get_stats(tinyusb_hid_stats_t *stats);
 
 #ifdef __cplusplus
 }
@@ -14,7 +14,9 @@
 
 #pragma once
 
+#include <stdint.h>
 #include "esp_err.h"
+#include "sdkconfig.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,7 +26,7 @@ extern "C" {
  * @brief This helper function creates and starts a task which wraps `tud_task()`.
  *
  * The wrapper function basically wraps tud_task and some log.
- * Default parameters: stack size and priority as configured, argument = NULL, not pinned to any core.
+ * Default parameters: stack size, priority and core affinity as configured, argument = NULL.
  * If you have more requirements for this task, you can create your own task which calls tud_task as the last step.
  *
  * @retval ESP_OK run tinyusb main task successfully
@@ -41,6 +43,26 @@ esp_err_t tusb_run_task(void);
  */
 esp_err_t tusb_stop_task(void);
 
+#if CONFIG_TINYUSB_TASK_STATS
+typedef struct {
+    uint32_t probes;         // timer interrupt probes handled
+    uint64_t latency_us_sum; // from the interrupt to the TinyUSB task, over the probes
+    uint32_t latency_us_max;
+    uint32_t run_time;       // FreeRTOS run time counter of the task, us on esp_timer, wraps
+    uint64_t elapsed_us;     // since the task started, the CPU share is the ratio of the
+                             // run_time and elapsed_us deltas between two calls
+} tusb_task_stats_t;
+
+/**
+ * @brief Get the latency and load counters of the task created by `tusb_run_task()`
+ *
+ * @param stats output
+ * @retval ESP_OK on success
+ * @retval ESP_ERR_INVALID_STATE tinyusb main task hasn't been created yet
+ */
+esp_err_t tusb_get_task_stats(tusb_task_stats_t *stats);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
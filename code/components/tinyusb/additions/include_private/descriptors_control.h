@@ -31,11 +31,26 @@ extern "C" {
 #endif
 //------------- HID Report Descriptor -------------//
 #if CFG_TUD_HID
+/*
+ * The keyboard has an interface of its own, in the boot protocol layout and
+ * without report ID, so that BIOS and bootloaders can use it. Mouse and
+ * consumer share the other one. Each interface has its own IN endpoint, so
+ * keys and motion do not wait for each other.
+ */
 enum {
-    REPORT_ID_KEYBOARD = 1,
+    HID_INSTANCE_KEYBOARD = 0,
+    HID_INSTANCE_POINTER,
+    HID_INSTANCE_TOTAL
+};
+
+enum {
+    REPORT_ID_KEYBOARD = 1, // not sent, the keyboard interface has no report ID
     REPORT_ID_MOUSE,
     REPORT_ID_CONSUMER,
 };
+
+#define EPNUM_HID_KEYBOARD 0x84
+#define EPNUM_HID_POINTER  0x85
 #endif
 
 //------------- Configuration Descriptor -------------//
@@ -50,7 +65,8 @@ enum {
 #   endif
 
 #   if CFG_TUD_HID
-    ITF_NUM_HID,
+    ITF_NUM_HID_KEYBOARD,
+    ITF_NUM_HID_POINTER,
 #   endif
 
     ITF_NUM_TOTAL
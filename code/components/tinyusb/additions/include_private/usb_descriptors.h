@@ -21,7 +21,7 @@
 extern "C" {
 #endif
 
-#define _PID_MAP(itf, n) ((CFG_TUD_##itf) << (n))
+#define _PID_MAP(itf, n) (((CFG_TUD_##itf) ? 1 : 0) << (n))
 
 extern tusb_desc_device_t descriptor_tinyusb;
 extern tusb_desc_strarray_device_t descriptor_str_tinyusb;
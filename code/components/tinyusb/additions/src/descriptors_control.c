@@ -18,9 +18,31 @@
 static const char *TAG = "tusb_desc";
 static tusb_desc_device_t s_descriptor;
 static char *s_str_descriptor[USB_STRING_DESCRIPTOR_ARRAY_SIZE];
-static uint8_t *s_config_descriptor = NULL;
+static const uint8_t *s_config_descriptor = NULL;
 #define MAX_DESC_BUF_SIZE 32
 
+#if CONFIG_TINYUSB_HID_MOUSE_XY_16BIT
+// X, Y position [-32767, 32767]
+#define MY_HID_REPORT_DESC_MOUSE_XY \
+        HID_USAGE       ( HID_USAGE_DESKTOP_X                    ) ,\
+        HID_USAGE       ( HID_USAGE_DESKTOP_Y                    ) ,\
+        HID_LOGICAL_MIN_N ( 0x8001, 2                            ) ,\
+        HID_LOGICAL_MAX_N ( 0x7fff, 2                            ) ,\
+        HID_REPORT_COUNT( 2                                      ) ,\
+        HID_REPORT_SIZE ( 16                                     ) ,\
+        HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE ) ,
+#else
+// X, Y position [-127, 127]
+#define MY_HID_REPORT_DESC_MOUSE_XY \
+        HID_USAGE       ( HID_USAGE_DESKTOP_X                    ) ,\
+        HID_USAGE       ( HID_USAGE_DESKTOP_Y                    ) ,\
+        HID_LOGICAL_MIN ( 0x81                                   ) ,\
+        HID_LOGICAL_MAX ( 0x7f                                   ) ,\
+        HID_REPORT_COUNT( 2                                      ) ,\
+        HID_REPORT_SIZE ( 8                                      ) ,\
+        HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE ) ,
+#endif
+
 // Mouse Report Descriptor Template
 #define MY_HID_REPORT_DESC_MOUSE(...) \
   HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP      )                   ,\
@@ -44,14 +66,9 @@ static uint8_t *s_config_descriptor = NULL;
         HID_REPORT_SIZE ( 3                                      ) ,\
         HID_INPUT       ( HID_CONSTANT                           ) ,\
       HID_USAGE_PAGE  ( HID_USAGE_PAGE_DESKTOP )                   ,\
-        /* X, Y position [-127, 127] */ \
-        HID_USAGE       ( HID_USAGE_DESKTOP_X                    ) ,\
-        HID_USAGE       ( HID_USAGE_DESKTOP_Y                    ) ,\
-        HID_LOGICAL_MIN ( 0x81                                   ) ,\
-        HID_LOGICAL_MAX ( 0x7f                                   ) ,\
-        HID_REPORT_COUNT( 2                                      ) ,\
-        HID_REPORT_SIZE ( 8                                      ) ,\
-        HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE ) ,\
+        MY_HID_REPORT_DESC_MOUSE_XY                                 \
+      /* The multiplier applies to the wheel and AC Pan in the same logical collection */ \
+      HID_COLLECTION ( HID_COLLECTION_LOGICAL  )                   ,\
       HID_USAGE_PAGE  ( HID_USAGE_PAGE_DESKTOP )                   ,\
         /* Verital wheel scroll [-127, 127] */ \
         HID_USAGE       ( HID_USAGE_DESKTOP_WHEEL                )  ,\
@@ -78,12 +95,17 @@ static uint8_t *s_config_descriptor = NULL;
         HID_REPORT_COUNT( 1                                      ) ,\
         HID_REPORT_SIZE ( 8                                      ) ,\
         HID_FEATURE     ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ) ,\
+      HID_COLLECTION_END                                          , \
     HID_COLLECTION_END                                            , \
   HID_COLLECTION_END \
 
 #if CFG_TUD_HID //HID Report Descriptor
-uint8_t const desc_hid_report[] = {
-    TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(REPORT_ID_KEYBOARD)),
+// Boot protocol layout, no report ID
+uint8_t const desc_hid_keyboard_report[] = {
+    TUD_HID_REPORT_DESC_KEYBOARD()
+};
+
+uint8_t const desc_hid_pointer_report[] = {
     MY_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(REPORT_ID_MOUSE)),
     TUD_HID_REPORT_DESC_CONSUMER(HID_REPORT_ID(REPORT_ID_CONSUMER))
 };
@@ -103,7 +125,10 @@ uint8_t const desc_configuration[] = {
 #   endif
 #   if CFG_TUD_HID
     // Interface number, string index, protocol, report descriptor len, EP In address, size & polling interval
-    TUD_HID_DESCRIPTOR(ITF_NUM_HID, 6, HID_PROTOCOL_NONE, sizeof(desc_hid_report), 0x84, 16, 10)
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID_KEYBOARD, 6, HID_PROTOCOL_KEYBOARD, sizeof(desc_hid_keyboard_report),
+                       EPNUM_HID_KEYBOARD, 8, CONFIG_TINYUSB_HID_POLL_INTERVAL),
+    TUD_HID_DESCRIPTOR(ITF_NUM_HID_POINTER, 6, HID_PROTOCOL_NONE, sizeof(desc_hid_pointer_report),
+                       EPNUM_HID_POINTER, CFG_TUD_HID_EP_BUFSIZE, CONFIG_TINYUSB_HID_POLL_INTERVAL)
 #   endif
 };
 
@@ -187,8 +212,8 @@ uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
 uint8_t const *tud_hid_descriptor_report_cb(uint8_t itf)
 {
     ESP_LOGD("TUSB", "%s(%u)", __func__, itf);
-    (void)itf;
-    return desc_hid_report;
+    // itf is the HID instance, in the order of the configuration descriptor
+    return itf == HID_INSTANCE_KEYBOARD ? desc_hid_keyboard_report : desc_hid_pointer_report;
 }
 #endif
 
@@ -250,8 +275,8 @@ void tusb_set_config_descriptor(const uint8_t *config_desc)
     }
     length = (config_descriptor[3]<<8) + config_descriptor[2];
     ESP_LOGI(TAG, "config desc size=%d", length);
-    s_config_descriptor = realloc(s_config_descriptor, length);
-    memcpy(s_config_descriptor, config_descriptor, length);
+    // not copied, it has to stay valid as long as the driver is installed
+    s_config_descriptor = config_descriptor;
 }
 
 tusb_desc_device_t *tusb_get_active_desc(void)
@@ -268,6 +293,5 @@ void tusb_clear_descriptor(void)
 {
     memset(&s_descriptor, 0, sizeof(s_descriptor));
     memset(&s_str_descriptor, 0, sizeof(s_str_descriptor));
-    free(s_config_descriptor);
     s_config_descriptor = NULL;
 }
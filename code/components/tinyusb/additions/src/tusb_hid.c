@@ -13,105 +13,640 @@
 // limitations under the License.
 
 
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <string.h>
 #include "esp_err.h"
 #include "sdkconfig.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
 #include "tusb_hid.h"
 #include "descriptors_control.h"
+#include "device/usbd_pvt.h"
 #include "esp_debug_helpers.h"
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+#include "soc/usb_reg.h"
+#include "soc/usb_struct.h"
+#endif
 
 static const char *TAG = "tusb_hid";
 
-uint8_t curr_resolution_multiplier = 1;
+// Logical value of the resolution multiplier feature, physical = logical + 1
+uint8_t curr_resolution_multiplier = 0;
 
-void tinyusb_hid_mouse_report(
-    uint8_t buttons, int8_t x, int8_t y, int8_t vertical, int8_t horizontal)
+#if CONFIG_TINYUSB_HID_MOUSE_XY_16BIT
+typedef int16_t mouse_xy_t;
+#else
+typedef int8_t mouse_xy_t;
+#endif
+
+// Mouse report layout, must match MY_HID_REPORT_DESC_MOUSE
+typedef struct TU_ATTR_PACKED {
+    uint8_t buttons;
+    mouse_xy_t x;
+    mouse_xy_t y;
+    int8_t wheel;
+    int8_t pan;
+} mouse_report_t;
+
+/*
+ * Report scheduler
+ *
+ * The reports are not sent by the tasks that make them. Each task only posts
+ * its new state into the mailbox of its report ID, and the TinyUSB task,
+ * which is the only one to write the HID endpoint, sends them one at a time:
+ * on request from a poster through usbd_defer_func(), and from
+ * tud_hid_report_complete_cb() as soon as the previous one is out.
+ *
+ * - keyboard and consumer states are queued as they are, every change is sent,
+ *   and refused when out of slots rather than lost
+ * - mouse motion is summed up while the buttons stay the same, a new slot is
+ *   started when they change so that a click lands where it was made
+ * - keyboard has an endpoint of its own, consumer goes before mouse on the
+ *   pointer one
+ *
+ * Each slot keeps the time its state was posted, the time from there to the
+ * completion of its report, when the host has polled it, is the delay the
+ * scheduler and the polling add to the input.
+ */
+// Deep enough for the key changes of a fast typist while the host does not
+// poll, the keyboard is scanned every 10 ms (or 10 frames) and a resume takes
+// 20 ms. Once full, a keyboard or consumer state is refused unless it has the
+// keys of the last one queued, and the caller posts it again, see the stats.
+#define KEYBOARD_SLOTS 32
+#define CONSUMER_SLOTS 16
+#define MOUSE_SLOTS    16
+
+typedef struct {
+    uint8_t report[8];
+    int64_t posted_us;
+} keyboard_slot_t;
+
+typedef struct {
+    uint16_t usage;
+    int64_t posted_us;
+} consumer_slot_t;
+
+typedef struct {
+    uint8_t buttons;
+    int32_t x, y, wheel, pan;
+    int64_t posted_us;  // last motion merged in
+} mouse_slot_t;
+
+// Ring of states, head is the next to send
+#define RING(type, n) struct { type slot[n]; uint8_t head, count; }
+#define RING_AT(r, i) ((r).slot[((r).head + (i)) % (sizeof((r).slot) / sizeof((r).slot[0]))])
+#define RING_LEN(r)   (sizeof((r).slot) / sizeof((r).slot[0]))
+
+static RING(keyboard_slot_t, KEYBOARD_SLOTS) s_keyboard;
+static RING(consumer_slot_t, CONSUMER_SLOTS) s_consumer;
+static RING(mouse_slot_t, MOUSE_SLOTS) s_mouse;
+static portMUX_TYPE s_hid_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// a call to hid_sched_run() is already deferred to the TinyUSB task
+static atomic_bool s_kick_pending = false;
+
+// Ask the host to resume again if it has not after this long
+#define HID_WAKEUP_RETRY_US 100000
+// time of the last remote wakeup, TinyUSB task only
+static int64_t s_wakeup_us = 0;
+// runs the scheduler again when a remote wakeup is due for a retry
+static esp_timer_handle_t s_wakeup_timer = NULL;
+
+// Run the scheduler again this long after TinyUSB refused a report, doubled
+// up to the max while it keeps refusing, so that the TinyUSB task does not
+// spin on its own event queue
+#define HID_RETRY_MIN_US 1000
+#define HID_RETRY_MAX_US 64000
+static esp_timer_handle_t s_retry_timer = NULL;
+// delay of the next retry, TinyUSB task only
+static uint32_t s_retry_us = HID_RETRY_MIN_US;
+
+// time of the last mount while no report has been sent since, TinyUSB task only
+static int64_t s_mount_us = 0;
+
+static tinyusb_hid_stats_t s_stats;
+
+// posting time of the report in flight, by HID instance, 0 if none
+static int64_t s_in_flight_us[HID_INSTANCE_TOTAL];
+
+static mouse_xy_t clamp_xy(int32_t v)
 {
-    ESP_LOGD(TAG, "buttons=%02x, x=%d, y=%d, vertical=%d, horizontal=%d", 
-        buttons, x, y, vertical, horizontal);
+    return v > TINYUSB_HID_MOUSE_XY_MAX ? TINYUSB_HID_MOUSE_XY_MAX :
+           v < -TINYUSB_HID_MOUSE_XY_MAX ? -TINYUSB_HID_MOUSE_XY_MAX : v;
+}
 
-    // Remote wakeup
-    if (tud_suspended()) {
-        // Wake up host if we are in suspend mode
-        // and REMOTE_WAKEUP feature is enabled by host
-        tud_remote_wakeup();
+static int8_t clamp_i8(int32_t v)
+{
+    return v > 127 ? 127 : v < -127 ? -127 : v;
+}
+
+/**
+ * Whether two boot keyboard reports press the same keys, in any order
+ */
+static bool same_keys(const uint8_t *a, const uint8_t *b)
+{
+    if (a[0] != b[0]) {
+        return false;
+    }
+    for (int i = 2; i < 8; i++) {
+        if (memchr(&b[2], a[i], 6) == NULL || memchr(&a[2], b[i], 6) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void hid_sched_flush(void)
+{
+    taskENTER_CRITICAL(&s_hid_lock);
+    s_stats.dropped[REPORT_ID_KEYBOARD - 1] += s_keyboard.count;
+    s_stats.dropped[REPORT_ID_MOUSE - 1] += s_mouse.count;
+    s_stats.dropped[REPORT_ID_CONSUMER - 1] += s_consumer.count;
+    s_keyboard.count = 0;
+    s_consumer.count = 0;
+    s_mouse.count = 0;
+    taskEXIT_CRITICAL(&s_hid_lock);
+}
+
+static void hid_sched_count(uint8_t instance, uint8_t id, bool ok, int64_t posted_us)
+{
+    if (ok) {
+        s_stats.sent[id - 1]++;
+        s_in_flight_us[instance] = posted_us;
+        if (s_mount_us != 0) {
+            s_stats.mount_to_report_us = esp_timer_get_time() - s_mount_us;
+            s_mount_us = 0;
+            ESP_LOGI(TAG, "first report %" PRIu32 " us after mount", s_stats.mount_to_report_us);
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+            if (s_stats.frames == 0) {
+                ESP_LOGW(TAG, "no start of frame has reached the SOF driver, the input is not "
+                         "synchronized to the polling");
+            }
+#endif
+        }
     } else {
-        // Send the 1st of report chain, the rest will be sent by tud_hid_report_complete_cb()
-        // skip if hid is not ready yet
-        int i = 0;
-        for (; i < 5 && !tud_hid_ready(); i++) {
-            vTaskDelay(5);
+        s_stats.failed[id - 1]++;
+    }
+}
+
+/**
+ * Account the delay from posting to polling of the report just completed.
+ * TinyUSB task only.
+ */
+static void hid_sched_polled(uint8_t instance)
+{
+    if (instance >= HID_INSTANCE_TOTAL || s_in_flight_us[instance] == 0) {
+        return;
+    }
+    uint32_t delay = esp_timer_get_time() - s_in_flight_us[instance];
+    s_in_flight_us[instance] = 0;
+
+    taskENTER_CRITICAL(&s_hid_lock);
+    s_stats.polled[instance]++;
+    s_stats.poll_delay_us_sum[instance] += delay;
+    if (delay > s_stats.poll_delay_us_max[instance]) {
+        s_stats.poll_delay_us_max[instance] = delay;
+    }
+    taskEXIT_CRITICAL(&s_hid_lock);
+}
+
+/**
+ * Send the state at the head of the keyboard ring. It is only taken off once
+ * TinyUSB has accepted it, the posters never change the head slot.
+ * @return false if TinyUSB refused the report
+ */
+static bool hid_send_keyboard(void)
+{
+    keyboard_slot_t kb;
+
+    taskENTER_CRITICAL(&s_hid_lock);
+    if (s_keyboard.count == 0) {
+        taskEXIT_CRITICAL(&s_hid_lock);
+        return true;
+    }
+    kb = RING_AT(s_keyboard, 0);
+    taskEXIT_CRITICAL(&s_hid_lock);
+
+    // boot protocol layout, no report ID
+    bool ok = tud_hid_n_keyboard_report(HID_INSTANCE_KEYBOARD, 0, kb.report[0], &kb.report[2]);
+    if (ok) {
+        taskENTER_CRITICAL(&s_hid_lock);
+        s_keyboard.head = (s_keyboard.head + 1) % RING_LEN(s_keyboard);
+        s_keyboard.count--;
+        taskEXIT_CRITICAL(&s_hid_lock);
+    }
+    hid_sched_count(HID_INSTANCE_KEYBOARD, REPORT_ID_KEYBOARD, ok, kb.posted_us);
+    return ok;
+}
+
+/**
+ * Send the state at the head of the consumer ring, or else of the mouse one,
+ * taken off once TinyUSB has accepted it. Motion merged into the mouse head
+ * slot meanwhile stays for the next report.
+ * @return false if TinyUSB refused the report
+ */
+static bool hid_send_pointer(void)
+{
+    uint16_t consumer;
+    mouse_report_t mouse;
+    int64_t posted_us = 0;
+    uint8_t id = 0;
+
+    taskENTER_CRITICAL(&s_hid_lock);
+    if (s_consumer.count > 0) {
+        consumer = RING_AT(s_consumer, 0).usage;
+        posted_us = RING_AT(s_consumer, 0).posted_us;
+        id = REPORT_ID_CONSUMER;
+    } else if (s_mouse.count > 0) {
+        mouse_slot_t *m = &RING_AT(s_mouse, 0);
+        mouse = (mouse_report_t) {
+            .buttons = m->buttons,
+            .x = clamp_xy(m->x),
+            .y = clamp_xy(m->y),
+            .wheel = clamp_i8(m->wheel),
+            .pan = clamp_i8(m->pan),
+        };
+        posted_us = m->posted_us;
+        id = REPORT_ID_MOUSE;
+    }
+    taskEXIT_CRITICAL(&s_hid_lock);
+
+    bool ok;
+    switch (id) {
+    case REPORT_ID_CONSUMER:
+        ok = tud_hid_n_report(HID_INSTANCE_POINTER, id, &consumer, sizeof(consumer));
+        break;
+    case REPORT_ID_MOUSE:
+        ok = tud_hid_n_report(HID_INSTANCE_POINTER, id, &mouse, sizeof(mouse));
+        break;
+    default:
+        return true;
+    }
+    if (ok) {
+        taskENTER_CRITICAL(&s_hid_lock);
+        if (id == REPORT_ID_CONSUMER) {
+            s_consumer.head = (s_consumer.head + 1) % RING_LEN(s_consumer);
+            s_consumer.count--;
+        } else {
+            // still the head slot, what does not fit in this report goes in the next one
+            mouse_slot_t *m = &RING_AT(s_mouse, 0);
+            m->x -= mouse.x;
+            m->y -= mouse.y;
+            m->wheel -= mouse.wheel;
+            m->pan -= mouse.pan;
+            if (m->x == 0 && m->y == 0 && m->wheel == 0 && m->pan == 0) {
+                s_mouse.head = (s_mouse.head + 1) % RING_LEN(s_mouse);
+                s_mouse.count--;
+            }
         }
-        if (i >= 5) {
-            ESP_LOGW(__func__, "tinyusb not ready");
+        taskEXIT_CRITICAL(&s_hid_lock);
+    }
+    hid_sched_count(HID_INSTANCE_POINTER, id, ok, posted_us);
+    return ok;
+}
+
+static bool hid_sched_pending(void)
+{
+    taskENTER_CRITICAL(&s_hid_lock);
+    bool pending = s_keyboard.count > 0 || s_consumer.count > 0 || s_mouse.count > 0;
+    taskEXIT_CRITICAL(&s_hid_lock);
+    return pending;
+}
+
+/**
+ * Signal remote wakeup, if the host allows it, and again every
+ * HID_WAKEUP_RETRY_US while it has not resumed and reports are queued, even
+ * if nothing else is posted meanwhile. TinyUSB task only.
+ */
+static void hid_sched_wakeup(void)
+{
+    if (!hid_sched_pending()) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (s_wakeup_us == 0 || now - s_wakeup_us >= HID_WAKEUP_RETRY_US) {
+        if (!tud_remote_wakeup()) {
+            // not allowed, the host resumes on its own
             return;
         }
+        s_wakeup_us = now;
+        s_stats.wakeups++;
+    }
+    // resume in progress
+    if (s_wakeup_timer != NULL) {
+        esp_timer_stop(s_wakeup_timer);
+        esp_timer_start_once(s_wakeup_timer, HID_WAKEUP_RETRY_US - (now - s_wakeup_us));
+    }
+}
 
-        tud_hid_mouse_report(REPORT_ID_MOUSE, buttons, x, y, vertical, horizontal);
+static void hid_sched_wakeup_done(void)
+{
+    s_wakeup_us = 0;
+    if (s_wakeup_timer != NULL) {
+        esp_timer_stop(s_wakeup_timer);
     }
 }
 
-void tinyusb_hid_keyboard_report(uint8_t *keycode)
+/**
+ * Send the next report on each endpoint that is free. TinyUSB task only.
+ */
+static void hid_sched_kick(void);
+
+static void hid_sched_run(void *arg)
 {
-    ESP_LOGD(TAG, "keycode: %02x %02x %02x %02x %02x %02x", 
-        keycode[0], keycode[1], keycode[2], keycode[3], keycode[4], keycode[5]);
+    (void) arg;
+    atomic_store(&s_kick_pending, false);
 
-    // Remote wakeup
+    if (!tud_mounted()) {
+        // nobody to send them to, and they would be stale on the next mount
+        hid_sched_flush();
+        memset(s_in_flight_us, 0, sizeof(s_in_flight_us));
+        hid_sched_wakeup_done();
+        return;
+    }
     if (tud_suspended()) {
-        // Wake up host if we are in suspend mode
-        // and REMOTE_WAKEUP feature is enabled by host
-        tud_remote_wakeup();
-    } else {
-        // Send the 1st of report chain, the rest will be sent by tud_hid_report_complete_cb()
-        // skip if hid is not ready yet
-        int i = 0;
-        for (; i < 5 && !tud_hid_ready(); i++) {
-            vTaskDelay(5);
-        }
-        if (i >= 5) {
-            ESP_LOGW(__func__, "tinyusb not ready");
-            return;
+        // kept until resume, the reports posted while suspended are what
+        // woke the host up and must not be lost
+        hid_sched_wakeup();
+        return;
+    }
+    hid_sched_wakeup_done();
+    // an endpoint that is busy is served again when its report is complete,
+    // a refused report stays queued and is tried again after a backoff
+    bool ok = true;
+    if (tud_hid_n_ready(HID_INSTANCE_KEYBOARD)) {
+        ok &= hid_send_keyboard();
+    }
+    if (tud_hid_n_ready(HID_INSTANCE_POINTER)) {
+        ok &= hid_send_pointer();
+    }
+    if (ok) {
+        s_retry_us = HID_RETRY_MIN_US;
+    } else if (s_retry_timer != NULL) {
+        esp_timer_stop(s_retry_timer);
+        esp_timer_start_once(s_retry_timer, s_retry_us);
+        s_retry_us = s_retry_us * 2 > HID_RETRY_MAX_US ? HID_RETRY_MAX_US : s_retry_us * 2;
+    }
+}
+
+/**
+ * Have the TinyUSB task send what has been posted, waking the host up first
+ * if it is suspended and allows it.
+ */
+static void hid_sched_kick(void)
+{
+    if (!atomic_exchange(&s_kick_pending, true)) {
+        usbd_defer_func(hid_sched_run, NULL, false);
+    }
+}
+
+uint8_t tinyusb_hid_resolution_multiplier(void)
+{
+    // See MY_HID_REPORT_DESC_MOUSE, logical [0, 15] maps to physical [1, 16]
+    uint8_t multiplier = curr_resolution_multiplier;
+    return multiplier > 15 ? 16 : multiplier + 1;
+}
+
+void tinyusb_hid_mouse_report(
+    uint8_t buttons, int16_t x, int16_t y, int8_t vertical, int8_t horizontal)
+{
+    ESP_LOGD(TAG, "buttons=%02x, x=%d, y=%d, vertical=%d, horizontal=%d", 
+        buttons, x, y, vertical, horizontal);
+
+    int64_t now = esp_timer_get_time();
+    taskENTER_CRITICAL(&s_hid_lock);
+    mouse_slot_t *m = s_mouse.count > 0 ? &RING_AT(s_mouse, s_mouse.count - 1) : NULL;
+    if (m == NULL || m->buttons != buttons) {
+        if (s_mouse.count < RING_LEN(s_mouse)) {
+            m = &RING_AT(s_mouse, s_mouse.count);
+            *m = (mouse_slot_t) {.buttons = buttons};
+            s_mouse.count++;
+        } else {
+            // out of slots, the last button change is merged into the one
+            // before, and the buttons it had are never reported
+            m->buttons = buttons;
+            s_stats.dropped[REPORT_ID_MOUSE - 1]++;
         }
+    }
+    m->x += x;
+    m->y += y;
+    m->wheel += vertical;
+    m->pan += horizontal;
+    m->posted_us = now;
+    taskEXIT_CRITICAL(&s_hid_lock);
+
+    hid_sched_kick();
+}
+
+bool tinyusb_hid_keyboard_report(uint8_t *keycode)
+{
+    ESP_LOGD(TAG, "keycode: %02x %02x %02x %02x %02x %02x", 
+        keycode[0], keycode[1], keycode[2], keycode[3], keycode[4], keycode[5]);
 
-        tud_hid_keyboard_report(REPORT_ID_KEYBOARD, keycode[0], &keycode[2]);
+    int64_t now = esp_timer_get_time();
+    taskENTER_CRITICAL(&s_hid_lock);
+    bool ok = true;
+    if (s_keyboard.count < RING_LEN(s_keyboard)) {
+        s_keyboard.count++;
+    } else if (same_keys(RING_AT(s_keyboard, s_keyboard.count - 1).report, keycode)) {
+        // out of slots, the newest state replaces the last one queued, which
+        // only differs by the order of the keys
+        s_stats.coalesced[REPORT_ID_KEYBOARD - 1]++;
+    } else {
+        // out of slots, replacing the last one queued would lose a key
+        s_stats.full[REPORT_ID_KEYBOARD - 1]++;
+        ok = false;
+    }
+    if (ok) {
+        keyboard_slot_t *kb = &RING_AT(s_keyboard, s_keyboard.count - 1);
+        memcpy(kb->report, keycode, 8);
+        kb->posted_us = now;
     }
+    taskEXIT_CRITICAL(&s_hid_lock);
+
+    hid_sched_kick();
+    return ok;
 }
 
-void tinyusb_hid_consumer_report(uint16_t keycode)
+bool tinyusb_hid_consumer_report(uint16_t keycode)
 {
     ESP_LOGD(TAG, "consumer code: %04x", keycode);
 
-    // Remote wakeup
-    if (tud_suspended()) {
-        // Wake up host if we are in suspend mode
-        // and REMOTE_WAKEUP feature is enabled by host
-        tud_remote_wakeup();
+    int64_t now = esp_timer_get_time();
+    taskENTER_CRITICAL(&s_hid_lock);
+    bool ok = true;
+    if (s_consumer.count < RING_LEN(s_consumer)) {
+        s_consumer.count++;
+    } else if (RING_AT(s_consumer, s_consumer.count - 1).usage == keycode) {
+        s_stats.coalesced[REPORT_ID_CONSUMER - 1]++;
     } else {
-        // Send the 1st of report chain, the rest will be sent by tud_hid_report_complete_cb()
-        // skip if hid is not ready yet
-        int i = 0;
-        for (; i < 5 && !tud_hid_ready(); i++) {
-            vTaskDelay(5);
-        }
-        if (i >= 5) {
-            ESP_LOGW(__func__, "tinyusb not ready");
-            return;
-        }
+        s_stats.full[REPORT_ID_CONSUMER - 1]++;
+        ok = false;
+    }
+    if (ok) {
+        RING_AT(s_consumer, s_consumer.count - 1) = (consumer_slot_t) {keycode, now};
+    }
+    taskEXIT_CRITICAL(&s_hid_lock);
 
-        tud_hid_report(REPORT_ID_CONSUMER, &keycode, sizeof(keycode));
+    hid_sched_kick();
+    return ok;
+}
+
+// remote wakeup and refused report retries
+static void on_sched_timer(void *arg)
+{
+    (void) arg;
+    hid_sched_kick();
+}
+
+void tinyusb_hid_mount(void)
+{
+    s_mount_us = esp_timer_get_time();
+    if (s_wakeup_timer == NULL) {
+        const esp_timer_create_args_t args = {.callback = on_sched_timer, .name = "hid_wakeup"};
+        ESP_ERROR_CHECK(esp_timer_create(&args, &s_wakeup_timer));
+    }
+    if (s_retry_timer == NULL) {
+        const esp_timer_create_args_t args = {.callback = on_sched_timer, .name = "hid_retry"};
+        ESP_ERROR_CHECK(esp_timer_create(&args, &s_retry_timer));
     }
 }
 
+void tinyusb_hid_resume(void)
+{
+    hid_sched_wakeup_done();
+    hid_sched_kick();
+}
+
+void tinyusb_hid_get_stats(tinyusb_hid_stats_t *stats)
+{
+    taskENTER_CRITICAL(&s_hid_lock);
+    *stats = s_stats;
+    taskEXIT_CRITICAL(&s_hid_lock);
+}
+
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+/*
+ * Start of frame
+ *
+ * TinyUSB hands the SOF event to the class drivers from its task, an
+ * application driver that claims no interface is enough to get it. The DCD
+ * masks the SOF interrupt again after each one, as it only uses it to detect
+ * the end of a remote wakeup, so it is unmasked here for the next frame.
+ *
+ * This relies on TinyUSB internals: the usbd_class_driver_t layout, and usbd
+ * dispatching DCD_EVENT_SOF to the class drivers. Both were checked against
+ * TinyUSB 0.12 to 0.14. From 0.15 on, the hook takes the frame count as well.
+ * Check both again before widening the range. Whether frames do arrive is
+ * logged at the first report after each mount.
+ */
+#if TUSB_VERSION_MAJOR != 0 || TUSB_VERSION_MINOR < 12 || TUSB_VERSION_MINOR > 14
+#error "CONFIG_TINYUSB_HID_SOF_SYNC is only checked against TinyUSB 0.12 to 0.14"
+#endif
+_Static_assert(__builtin_types_compatible_p(__typeof__(((usbd_class_driver_t *)0)->sof),
+                                            void (*)(uint8_t)),
+               "usbd_class_driver_t.sof changed, see the start of frame driver");
+
+// The mask is changed by the DCD interrupt as well, which is allocated on the
+// core that called tinyusb_driver_install(), from app_main(). A critical
+// section only masks the interrupts of its own core, so the TinyUSB task has
+// to be pinned there too.
+#if CONFIG_TINYUSB_TASK_AFFINITY != CONFIG_ESP_MAIN_TASK_AFFINITY
+#error "CONFIG_TINYUSB_HID_SOF_SYNC needs CONFIG_TINYUSB_TASK_AFFINITY set to the main task core"
+#endif
+static portMUX_TYPE s_sof_mask_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void __attribute__((weak)) tinyusb_hid_sof_cb(int64_t sof_us)
+{
+    (void) sof_us;
+}
+
+/**
+ * Unmask the SOF interrupt. The read-modify-write runs with the interrupts
+ * of this core off, which is the core of the DCD interrupt, see above.
+ */
+static void sof_unmask(void)
+{
+    taskENTER_CRITICAL(&s_sof_mask_lock);
+    USB0.gintmsk |= USB_SOFMSK_M;
+    taskEXIT_CRITICAL(&s_sof_mask_lock);
+}
+
+static void sof_driver_init(void)
+{
+}
+
+static void sof_driver_reset(uint8_t rhport)
+{
+    (void) rhport;
+    // after dcd_init() and the bus reset handler have set the interrupt mask
+    sof_unmask();
+}
+
+static uint16_t sof_driver_open(uint8_t rhport, tusb_desc_interface_t const *desc_intf, uint16_t max_len)
+{
+    (void) rhport;
+    (void) desc_intf;
+    (void) max_len;
+    return 0;
+}
+
+static bool sof_driver_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request)
+{
+    (void) rhport;
+    (void) stage;
+    (void) request;
+    return false;
+}
+
+static bool sof_driver_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+    (void) rhport;
+    (void) ep_addr;
+    (void) result;
+    (void) xferred_bytes;
+    return false;
+}
+
+static void sof_driver_sof(uint8_t rhport)
+{
+    (void) rhport;
+    int64_t now = esp_timer_get_time();
+    sof_unmask();
+    s_stats.frames++;
+    tinyusb_hid_sof_cb(now);
+}
+
+static const usbd_class_driver_t s_sof_driver = {
+    .name = "SOF",
+    .init = sof_driver_init,
+    .reset = sof_driver_reset,
+    .open = sof_driver_open,
+    .control_xfer_cb = sof_driver_control_xfer_cb,
+    .xfer_cb = sof_driver_xfer_cb,
+    .sof = sof_driver_sof,
+};
+
+usbd_class_driver_t const *usbd_app_driver_get_cb(uint8_t *driver_count)
+{
+    *driver_count = 1;
+    return &s_sof_driver;
+}
+#endif
+
 /************************************************** TinyUSB callbacks ***********************************************/
 // Invoked when sent REPORT successfully to host
 // Application can use this to send the next report
 // Note: For composite reports, report[0] is report ID
 void tud_hid_report_complete_cb(uint8_t itf, uint8_t const *report, uint8_t len)
 {
-    (void) itf;
     (void) report;
     (void) len;
+    hid_sched_polled(itf);
+    hid_sched_run(NULL);
 }
 
 // Invoked when received GET_REPORT control request
@@ -119,12 +654,11 @@ void tud_hid_report_complete_cb(uint8_t itf, uint8_t const *report, uint8_t len)
 // Return zero will cause the stack to STALL request
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen)
 {
-    (void) instance;
     // esp_backtrace_print(8);
     // ESP_LOGI(TAG, "get instance %d, report id %d, report type %d, len %d", 
     //   instance, report_id, report_type, reqlen);
 
-    if (report_type == HID_REPORT_TYPE_FEATURE) {
+    if (report_type == HID_REPORT_TYPE_FEATURE && instance == HID_INSTANCE_POINTER) {
       if (report_id == REPORT_ID_MOUSE && reqlen >= 1) {
         /**
          * Return the resolution multiplier for high-resolution pointer & wheel.
@@ -148,19 +682,18 @@ void __attribute__((weak)) kb_led_cb(uint8_t kbd_leds)
 // received data on OUT endpoint ( Report ID = 0, Type = 0 )
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize)
 {
-  (void) instance;
   ESP_LOGI(TAG, "set instance %d, report id %d, report type %d, len %d, buf[0] 0x%02x", 
     instance, report_id, report_type, bufsize, buffer[0]);
 
   if (report_type == HID_REPORT_TYPE_OUTPUT) {
     // Set keyboard LED e.g Capslock, Numlock etc...
-    if (report_id == REPORT_ID_KEYBOARD) {
+    if (instance == HID_INSTANCE_KEYBOARD) {
       // bufsize should be (at least) 1
       if ( bufsize < 1 ) return;
 
       kb_led_cb(buffer[0]);
     }
-  } else if (report_type == HID_REPORT_TYPE_FEATURE) {
+  } else if (report_type == HID_REPORT_TYPE_FEATURE && instance == HID_INSTANCE_POINTER) {
     if (report_id == REPORT_ID_MOUSE) {
       /**
        * Set the resolution multiplier.
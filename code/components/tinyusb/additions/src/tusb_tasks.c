@@ -12,23 +12,96 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <stdint.h>
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "esp_check.h"
+#include "esp_timer.h"
 #include "tinyusb.h"
 #include "tusb_tasks.h"
+#if CONFIG_TINYUSB_TASK_STATS
+#include "driver/gptimer.h"
+#include "device/usbd_pvt.h"
+#endif
 
 const static char *TAG = "tusb_tsk";
 static TaskHandle_t s_tusb_tskh;
+static StaticTask_t s_tusb_tcb;
+static StackType_t s_tusb_stack[CONFIG_TINYUSB_TASK_STACK_SIZE];
+
+#if CONFIG_TINYUSB_TASK_STATS
+/*
+ * The probe goes from a timer interrupt to the TinyUSB task through
+ * usbd_defer_func(), the same queue as the events of the USB interrupt, so
+ * its latency is theirs: the time for the task to get the CPU, plus the
+ * events queued before.
+ */
+#define PROBE_TIMER_HZ 1000000
+
+static gptimer_handle_t s_probe_timer;
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static tusb_task_stats_t s_stats;
+static int64_t s_stats_start_us;
+
+static void probe_handled(void *param)
+{
+    uint32_t latency = (uint32_t)esp_timer_get_time() - (uint32_t)(uintptr_t)param;
+
+    taskENTER_CRITICAL(&s_stats_lock);
+    s_stats.probes++;
+    s_stats.latency_us_sum += latency;
+    if (latency > s_stats.latency_us_max) {
+        s_stats.latency_us_max = latency;
+    }
+    taskEXIT_CRITICAL(&s_stats_lock);
+}
+
+static bool IRAM_ATTR probe_alarm_cb(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata,
+                                     void *user_ctx)
+{
+    usbd_defer_func(probe_handled, (void *)(uintptr_t)esp_timer_get_time(), true);
+    // usbd_defer_func() yields to the TinyUSB task itself if needed
+    return false;
+}
+
+static esp_err_t probe_start(void)
+{
+    const gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = PROBE_TIMER_HZ,
+    };
+    ESP_RETURN_ON_ERROR(gptimer_new_timer(&timer_config, &s_probe_timer), TAG, "probe timer");
+    const gptimer_event_callbacks_t cbs = {.on_alarm = probe_alarm_cb};
+    ESP_RETURN_ON_ERROR(gptimer_register_event_callbacks(s_probe_timer, &cbs, NULL), TAG, "probe timer");
+    const gptimer_alarm_config_t alarm_config = {
+        .alarm_count = PROBE_TIMER_HZ / CONFIG_TINYUSB_TASK_STATS_PROBE_HZ,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    ESP_RETURN_ON_ERROR(gptimer_set_alarm_action(s_probe_timer, &alarm_config), TAG, "probe timer");
+    ESP_RETURN_ON_ERROR(gptimer_enable(s_probe_timer), TAG, "probe timer");
+    return gptimer_start(s_probe_timer);
+}
+#endif
 
 /**
  * @brief This top level thread processes all usb events and invokes callbacks
+ *
+ * tud_task() blocks on the DCD event queue and returns once it has handled
+ * the events queued, the task never runs without an event to handle.
  */
 static void tusb_device_task(void *arg)
 {
     ESP_LOGD(TAG, "tinyusb task started");
+#if CONFIG_TINYUSB_TASK_STATS
+    s_stats_start_us = esp_timer_get_time();
+    if (probe_start() != ESP_OK) {
+        ESP_LOGW(TAG, "no latency probe");
+    }
+#endif
     while (1) { // RTOS forever loop
         tud_task();
     }
@@ -39,8 +112,10 @@ esp_err_t tusb_run_task(void)
     // This function is not garanteed to be thread safe, if invoked multiple times without calling `tusb_stop_task`, will cause memory leak
     // doing a sanity check anyway
     ESP_RETURN_ON_FALSE(!s_tusb_tskh, ESP_ERR_INVALID_STATE, TAG, "TinyUSB main task already started");
-    // Create a task for tinyusb device stack:
-    xTaskCreate(tusb_device_task, "TinyUSB", CONFIG_TINYUSB_TASK_STACK_SIZE, NULL, CONFIG_TINYUSB_TASK_PRIORITY, &s_tusb_tskh);
+    // Create a task for tinyusb device stack, not on the heap
+    s_tusb_tskh = xTaskCreateStaticPinnedToCore(tusb_device_task, "TinyUSB", CONFIG_TINYUSB_TASK_STACK_SIZE,
+                                                NULL, CONFIG_TINYUSB_TASK_PRIORITY, s_tusb_stack, &s_tusb_tcb,
+                                                CONFIG_TINYUSB_TASK_AFFINITY);
     ESP_RETURN_ON_FALSE(s_tusb_tskh, ESP_FAIL, TAG, "create TinyUSB main task failed");
     return ESP_OK;
 }
@@ -52,3 +127,19 @@ esp_err_t tusb_stop_task(void)
     s_tusb_tskh = NULL;
     return ESP_OK;
 }
+
+#if CONFIG_TINYUSB_TASK_STATS
+esp_err_t tusb_get_task_stats(tusb_task_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(s_tusb_tskh, ESP_ERR_INVALID_STATE, TAG, "TinyUSB main task not started yet");
+    TaskStatus_t status;
+    vTaskGetInfo(s_tusb_tskh, &status, pdFALSE, eInvalid);
+
+    taskENTER_CRITICAL(&s_stats_lock);
+    *stats = s_stats;
+    taskEXIT_CRITICAL(&s_stats_lock);
+    stats->run_time = status.ulRunTimeCounter;
+    stats->elapsed_us = esp_timer_get_time() - s_stats_start_us;
+    return ESP_OK;
+}
+#endif
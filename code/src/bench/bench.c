@@ -0,0 +1,154 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Microbenchmark runner
+ *
+ * A case is run for a few warm-up rounds, then timed over BENCH_ROUNDS
+ * rounds. The minimum is the one to compare between changes, the median and
+ * the maximum show how much the interrupts and the caches got in the way.
+ */
+
+#include "bench.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_cpu.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <time.h>
+#endif
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+// Odd, for the median
+#define BENCH_ROUNDS 31
+#define BENCH_WARMUP_ROUNDS 2
+// Run the cases again this often, for a monitor attached late
+#define BENCH_REPEAT_MS 10000
+
+#ifdef ESP_PLATFORM
+// The cycle counter of the core, app_main stays on one
+typedef uint32_t bench_tick_t;
+#define BENCH_UNIT "cycles"
+static inline bench_tick_t bench_now(void) { return esp_cpu_get_cycle_count(); }
+#else
+typedef uint64_t bench_tick_t;
+#define BENCH_UNIT "ns"
+static inline bench_tick_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+volatile uint32_t bench_sink;
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Time of one iteration in 1/100 unit
+static void print_x100(uint64_t x100) {
+    printf(",%" PRIu64 ".%02u", x100 / 100, (unsigned)(x100 % 100));
+}
+
+static void run_case(const char *target, const bench_case_t *c) {
+    uint64_t rounds[BENCH_ROUNDS];
+    for (int i = 0; i < BENCH_WARMUP_ROUNDS; i++) {
+        c->run(c->iterations);
+    }
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        bench_tick_t start = bench_now();
+        c->run(c->iterations);
+        bench_tick_t elapsed = bench_now() - start;
+        rounds[i] = (uint64_t)elapsed * 100 / c->iterations;
+    }
+    qsort(rounds, BENCH_ROUNDS, sizeof(rounds[0]), compare_u64);
+
+    printf("BENCH,%s,%s,%" PRIu32, target, c->name, c->iterations);
+    print_x100(rounds[0]);
+    print_x100(rounds[BENCH_ROUNDS / 2]);
+    print_x100(rounds[BENCH_ROUNDS - 1]);
+    printf("," BENCH_UNIT "\n");
+}
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+void bench_run_all(const char *target) {
+    static bool is_setup = false;
+    if (!is_setup) {
+        bench_cases_setup();
+        is_setup = true;
+    }
+    for (int i = 0; i < bench_nr_cases; i++) {
+        run_case(target, &bench_cases[i]);
+        fflush(stdout);
+#ifdef ESP_PLATFORM
+        // the idle task feeds the task watchdog
+        vTaskDelay(1);
+#endif
+    }
+    printf("BENCH,%s,end\n", target);
+    fflush(stdout);
+}
+
+#ifdef ESP_PLATFORM
+void app_main(void) {
+    // after the boot messages
+    vTaskDelay(pdMS_TO_TICKS(1000));
+    while (1) {
+        bench_run_all("esp32s3");
+        vTaskDelay(pdMS_TO_TICKS(BENCH_REPEAT_MS));
+    }
+}
+#else
+int main(void) {
+    bench_run_all("native");
+    return 0;
+}
+#endif
@@ -0,0 +1,69 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Microbenchmarks
+ *
+ * The input hot paths timed in a loop, on the ESP32-S3 in the "bench"
+ * environment of platformio.ini, and on the host in "bench_native". Only the
+ * portable code is timed: the inputs are recorded matrix states, byte
+ * streams and motion, no GPIO, UART or USB is involved. Each case prints
+ *
+ *     BENCH,<target>,<case>,<iterations>,<min>,<median>,<max>,<unit>
+ *
+ * with the time of one iteration over the rounds, in CPU cycles on the
+ * device and in nanoseconds on the host. tools/bench_compare.py compares
+ * two runs.
+ */
+#ifndef MY_BENCH_H
+#define MY_BENCH_H
+
+#include <stdint.h>
+
+/**
+ * Run a case iterations times
+ */
+typedef void (*bench_fn_t)(uint32_t iterations);
+
+typedef struct {
+    const char *name;
+    bench_fn_t run;
+    uint32_t iterations;  // per round, enough for a round to take about a millisecond
+} bench_case_t;
+
+extern const bench_case_t bench_cases[];
+extern const int bench_nr_cases;
+
+// Results go here, so that the compiler keeps the work
+extern volatile uint32_t bench_sink;
+
+/**
+ * Build the inputs of the cases, once before running them
+ */
+void bench_cases_setup(void);
+
+/**
+ * Run all the cases and print the results
+ * @param target name of the build, "esp32s3" or "native"
+ */
+void bench_run_all(const char *target);
+
+#endif
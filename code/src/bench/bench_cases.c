@@ -0,0 +1,360 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Microbenchmark cases
+ *
+ * The cases call the code the firmware runs: the scan kernel of
+ * keyboard_task() without the GPIO reads, the key lookup, the PS2 decoding
+ * and the per-frame pointer pipeline of poll_trackpoint().
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bench.h"
+#include "kb_scan.h"
+#include "keymap.h"
+#include "pointer.h"
+#include "ps2_packet.h"
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+// TINYUSB_HID_MOUSE_XY_MAX with CONFIG_TINYUSB_HID_MOUSE_XY_16BIT
+#define BENCH_MOUSE_XY_MAX 32767
+
+// Packets of the recorded stream, a power of 2
+#define PS2_STREAM_PACKETS 256
+// USB frame and trackpoint packet intervals of the pointer pipeline
+#define FRAME_US 1000
+#define PACKET_US 10000
+
+typedef struct {
+    uint16_t rows[COL_NUM];  // rows connected to each column
+    bool fn_down;
+    bool fn_locked;
+} matrix_t;
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+// no key, two letters, the rollover limit with modifiers, and a ghost
+static matrix_t matrix_idle, matrix_typing, matrix_rollover, matrix_ghost;
+// Fn held with a hotkey and the precision key, and F keys with the Fn lock on
+static matrix_t matrix_fn, matrix_fn_lock;
+// typing up to the rollover limit, one key more each scan
+static matrix_t matrix_report[8];
+
+// lookup variant: the keymap indexed by position, instead of searched
+static int16_t keymap_index[COL_NUM][ROW_NUM];
+static uint8_t lookup_cols[COL_NUM * ROW_NUM], lookup_rows[COL_NUM * ROW_NUM];
+
+static uint8_t ps2_stream[PS2_STREAM_PACKETS * 3];
+
+// raw motion of a stick push, one value per packet
+static int8_t motion[64];
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+// Reproducible pseudo-random inputs
+static uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void press(matrix_t *m, int hidkey) {
+    for (int col = 0; col < COL_NUM; col++) {
+        for (int row = 0; row < ROW_NUM; row++) {
+            if (search_hid_key(col, row) == hidkey) {
+                m->rows[col] |= 1u << row;
+                return;
+            }
+        }
+    }
+}
+
+// the scan of keyboard_task(), from the rows read on each column
+static void scan_matrix(const matrix_t *m, kb_scan_t *scan, const kb_scan_t *last) {
+    kb_scan_begin(scan, m->fn_down, m->fn_locked);
+    for (int col = 0; col < COL_NUM; col++) {
+        kb_scan_column(scan, col, m->rows[col]);
+    }
+    kb_scan_end(scan, last);
+}
+
+static void run_scan(const matrix_t *m, uint32_t iterations) {
+    kb_scan_t scan, last;
+    kb_scan_begin(&last, false, false);
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        scan_matrix(m, &scan, &last);
+        acc += (uint32_t)scan.hid + scan.hotkey + scan.kb_flags;
+    }
+    bench_sink = acc;
+}
+
+static void bench_scan_idle(uint32_t n) { run_scan(&matrix_idle, n); }
+static void bench_scan_typing(uint32_t n) { run_scan(&matrix_typing, n); }
+static void bench_scan_rollover(uint32_t n) { run_scan(&matrix_rollover, n); }
+static void bench_scan_ghost(uint32_t n) { run_scan(&matrix_ghost, n); }
+static void bench_scan_fn(uint32_t n) { run_scan(&matrix_fn, n); }
+static void bench_scan_fn_lock(uint32_t n) { run_scan(&matrix_fn_lock, n); }
+
+// every position of the matrix in turn, mostly misses like the table end
+static void bench_lookup_linear(uint32_t n) {
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        int k = i % (COL_NUM * ROW_NUM);
+        acc += search_hid_key(lookup_cols[k], lookup_rows[k]);
+    }
+    bench_sink = acc;
+}
+
+static void bench_lookup_index(uint32_t n) {
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        int k = i % (COL_NUM * ROW_NUM);
+        acc += keymap_index[lookup_cols[k]][lookup_rows[k]];
+    }
+    bench_sink = acc;
+}
+
+static void bench_lookup_fn(uint32_t n) {
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        int k = i % (COL_NUM * ROW_NUM);
+        acc += search_fn(lookup_cols[k], lookup_rows[k]) != NULL;
+    }
+    bench_sink = acc;
+}
+
+// a scan with the reports to send, as keyboard_task() decides them
+static void bench_report(uint32_t n) {
+    kb_scan_t scan, last;
+    kb_scan_begin(&last, false, false);
+    uint32_t changes = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        scan_matrix(&matrix_report[i % 8], &scan, &last);
+        if (scan.hid != last.hid) {
+            changes++;
+        }
+        if (scan.hotkey != last.hotkey) {
+            changes++;
+        }
+        last = scan;
+    }
+    bench_sink = changes + (uint32_t)last.hid;
+}
+
+// one byte per iteration, as poll_trackpoint() reads them from the UART
+static void bench_ps2_decode(uint32_t n) {
+    ps2_packet_t packet = {0};
+    int32_t dx = 0, dy = 0;
+    uint8_t buttons = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (ps2_packet_feed(&packet, ps2_stream[i % sizeof(ps2_stream)]) == PS2_PACKET_DONE) {
+            int16_t px, py;
+            ps2_packet_motion(&packet, &px, &py);
+            buttons = packet.data[0] & PS2_PACKET_BUTTONS;
+            dx += px;
+            dy -= py;
+        }
+    }
+    bench_sink = dx + dy + buttons;
+}
+
+static void bench_pointer_scale(uint32_t n) {
+    const pointer_profile_t *profile = pointer_profile(POINTER_PROFILE_NORMAL);
+    int32_t acc = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        // past the end of the table every 8th time
+        acc += pointer_scale(profile, (int32_t)(i % 80) - 40);
+    }
+    bench_sink = acc;
+}
+
+static void bench_pointer_filter(uint32_t n) {
+    pointer_filter_t filter;
+    pointer_filter_reset(&filter);
+    int32_t acc = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        int32_t x, y;
+        int32_t d = motion[i % 64] * POINTER_Q8_ONE;
+        pointer_filter_step(&filter, d, -d, FRAME_US, &x, &y);
+        acc += x + y;
+    }
+    bench_sink = acc;
+}
+
+static void bench_pointer_resample(uint32_t n) {
+    pointer_resample_t resample;
+    pointer_resample_reset(&resample);
+    int32_t acc = 0;
+    int64_t now = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        now += FRAME_US;
+        if (i % (PACKET_US / FRAME_US) == 0) {
+            int32_t d = motion[i / (PACKET_US / FRAME_US) % 64] * POINTER_Q8_ONE;
+            pointer_resample_push(&resample, d, -d, PACKET_US, now);
+        }
+        int32_t x, y;
+        pointer_resample_take(&resample, now, true, &x, &y);
+        acc += x + y;
+    }
+    bench_sink = acc;
+}
+
+/**
+ * The USB frames of poll_trackpoint(), a packet every PACKET_US, through the
+ * pipeline with every stage on.
+ * @param kb_flags POINTER_KB_* held meanwhile
+ */
+static void run_pointer_pipeline(uint32_t kb_flags, uint32_t iterations) {
+    pointer_pipeline_t pipeline;
+    pointer_pipeline_reset(&pipeline,
+                           POINTER_PIPELINE_FN_PAN | POINTER_PIPELINE_RESAMPLE |
+                               POINTER_PIPELINE_EXTRAPOLATE | POINTER_PIPELINE_FILTER);
+    int32_t acc = 0;
+    int64_t now = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        now += FRAME_US;
+        pointer_frame_in_t in = {
+            .is_recv = i % (PACKET_US / FRAME_US) == 0,
+            .kb_flags = kb_flags,
+            .period_us = PACKET_US,
+            .now_us = now,
+            .multiplier = 16,
+            .xy_limit = BENCH_MOUSE_XY_MAX,
+        };
+        if (in.is_recv) {
+            in.dx = motion[i / (PACKET_US / FRAME_US) % 64];
+            in.dy = -in.dx;
+        }
+        pointer_frame_out_t out;
+        pointer_pipeline_step(&pipeline, &in, &out);
+        acc += out.x + out.y + out.wheel + out.pan + out.midkey;
+    }
+    bench_sink = acc;
+}
+
+static void bench_pointer_pipeline(uint32_t n) { run_pointer_pipeline(0, n); }
+static void bench_pointer_precision(uint32_t n) { run_pointer_pipeline(POINTER_KB_PRECISION, n); }
+static void bench_pointer_fn_scroll(uint32_t n) { run_pointer_pipeline(POINTER_KB_FN, n); }
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+void bench_cases_setup(void) {
+    press(&matrix_typing, KEY_A);
+    press(&matrix_typing, KEY_S);
+    static const int rollover[] = {KEY_LEFTCTRL, KEY_LEFTSHIFT, KEY_Q, KEY_W, KEY_E,
+                                   KEY_R,        KEY_T,         KEY_Y};
+    for (size_t i = 0; i < sizeof(rollover) / sizeof(rollover[0]); i++) {
+        press(&matrix_rollover, rollover[i]);
+        // the keys of the ones before and this one
+        for (size_t j = i; j < sizeof(matrix_report) / sizeof(matrix_report[0]); j++) {
+            press(&matrix_report[j], rollover[i]);
+        }
+    }
+    // three keys of a rectangle, read with the fourth corner as a phantom
+    matrix_ghost.rows[0] = 0b011;
+    matrix_ghost.rows[1] = 0b011;
+
+    // the hotkeys of the Fn table of km_x61.c: Fn + Space, precision, and
+    // the one at column 4 row 4, with a letter that has no Fn function
+    matrix_fn.fn_down = true;
+    press(&matrix_fn, KEY_SPACE);
+    matrix_fn.rows[4] |= 1u << 4;
+    press(&matrix_fn, KEY_A);
+    matrix_fn_lock.fn_locked = true;
+    press(&matrix_fn_lock, KEY_F1);
+    press(&matrix_fn_lock, KEY_F5);
+    press(&matrix_fn_lock, KEY_A);
+
+    int n = 0;
+    for (int col = 0; col < COL_NUM; col++) {
+        for (int row = 0; row < ROW_NUM; row++) {
+            keymap_index[col][row] = search_hid_key(col, row);
+            lookup_cols[n] = col;
+            lookup_rows[n] = row;
+            n++;
+        }
+    }
+
+    // small moves with an occasional larger one, some negative, buttons up
+    uint32_t seed = 0x2545f491;
+    for (int i = 0; i < PS2_STREAM_PACKETS; i++) {
+        int32_t r = xorshift32(&seed);
+        int dx = (r & 0x0f) - 8, dy = ((r >> 4) & 0x0f) - 8;
+        if ((r >> 8 & 0x1f) == 0) {
+            dx *= 30;
+        }
+        ps2_stream[3 * i] = PS2_PACKET_ALWAYS_1 | (dx < 0 ? 0x10 : 0) | (dy < 0 ? 0x20 : 0);
+        ps2_stream[3 * i + 1] = dx & 0xff;
+        ps2_stream[3 * i + 2] = dy & 0xff;
+    }
+
+    for (int i = 0; i < 64; i++) {
+        // ramp up, hold, release
+        motion[i] = i < 16 ? i : i < 48 ? 16 : 0;
+    }
+    pointer_profiles_init();
+}
+
+const bench_case_t bench_cases[] = {
+    {"scan_idle", bench_scan_idle, 1000},
+    {"scan_typing", bench_scan_typing, 1000},
+    {"scan_rollover", bench_scan_rollover, 200},
+    {"scan_ghost", bench_scan_ghost, 1000},
+    {"scan_fn", bench_scan_fn, 1000},
+    {"scan_fn_lock", bench_scan_fn_lock, 1000},
+    {"lookup_linear", bench_lookup_linear, 2048},
+    {"lookup_index", bench_lookup_index, 16384},
+    {"lookup_fn", bench_lookup_fn, 4096},
+    {"report", bench_report, 1000},
+    {"ps2_decode", bench_ps2_decode, 16384},
+    {"pointer_scale", bench_pointer_scale, 16384},
+    {"pointer_filter", bench_pointer_filter, 4096},
+    {"pointer_resample", bench_pointer_resample, 4096},
+    {"pointer_pipeline", bench_pointer_pipeline, 2048},
+    {"pointer_precision", bench_pointer_precision, 2048},
+    {"pointer_fn_scroll", bench_pointer_fn_scroll, 2048},
+};
+
+const int bench_nr_cases = sizeof(bench_cases) / sizeof(bench_cases[0]);
@@ -0,0 +1,115 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Heap guard
+ */
+
+#include "heap_guard.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+// Look at the heap this often
+#define HEAP_GUARD_INTERVAL_US 1000000
+
+// Abort on an allocation after the boot, instead of logging it
+// #define HEAP_GUARD_ABORT
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+static const char *TAG = "heap-guard";
+
+static esp_timer_handle_t guard_timer = NULL;
+static size_t boot_blocks = 0;
+static size_t boot_bytes = 0;
+// the worst seen, only logged once
+static size_t max_bytes = 0;
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+static void on_guard_timer(void *arg) {
+    (void)arg;
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+    // a free followed by an allocation of the same size is not seen, the
+    // point is to catch the allocations that go on and fragment the heap
+    if (info.allocated_blocks <= boot_blocks && info.total_allocated_bytes <= boot_bytes) {
+        return;
+    }
+#ifdef HEAP_GUARD_ABORT
+    ESP_LOGE(TAG, "Heap allocated after boot: %d blocks, %d bytes",
+             (int)(info.allocated_blocks - boot_blocks),
+             (int)(info.total_allocated_bytes - boot_bytes));
+    abort();
+#else
+    if (info.total_allocated_bytes > max_bytes) {
+        max_bytes = info.total_allocated_bytes;
+        ESP_LOGW(TAG, "Heap allocated after boot: %d blocks, %d bytes, %" PRIu32
+                 " bytes free at least",
+                 (int)(info.allocated_blocks - boot_blocks),
+                 (int)(info.total_allocated_bytes - boot_bytes),
+                 (uint32_t)info.minimum_free_bytes);
+    }
+#endif
+}
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+void heap_guard_arm(void) {
+    if (guard_timer == NULL) {
+        const esp_timer_create_args_t args = {.callback = on_guard_timer, .name = "heap_guard"};
+        ESP_ERROR_CHECK(esp_timer_create(&args, &guard_timer));
+    }
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+    boot_blocks = info.allocated_blocks;
+    boot_bytes = info.total_allocated_bytes;
+    max_bytes = boot_bytes;
+    ESP_LOGI(TAG, "Armed: %d blocks, %d bytes allocated at boot, %d bytes free",
+             (int)boot_blocks, (int)boot_bytes, (int)info.total_free_bytes);
+    esp_timer_stop(guard_timer);
+    ESP_ERROR_CHECK(esp_timer_start_periodic(guard_timer, HEAP_GUARD_INTERVAL_US));
+}
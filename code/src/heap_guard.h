@@ -0,0 +1,38 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Heap guard
+ *
+ * Everything is allocated at boot: the tasks, queues and buffers of our own
+ * are static, and the drivers that only take heap memory (UART, gptimer,
+ * esp_timer) are installed before app_main returns. Once armed, the guard
+ * checks periodically that the heap has not grown since.
+ */
+#ifndef MY_HEAP_GUARD_H
+#define MY_HEAP_GUARD_H
+
+/**
+ * Take the heap in use as the baseline, at the end of the boot
+ */
+void heap_guard_arm(void);
+
+#endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -8,36 +9,57 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
+#include "keyboard.h"
 #include "keymap/keymap.h"
 #include "pin_cfg.h"
+#include "pointer/pointer.h"
+#include "prof.h"
 #include "sdkconfig.h"
 #include "tinyusb.h"
+#include "tlog.h"
 #include "tusb.h"
 #include "tusb_hid.h"
+#include "tusb_tasks.h"
+#include "usb_state.h"
+
+// time each key lookup of the scan kernel, see prof.h
+#define KB_SCAN_LOOKUP_BEGIN() PROF_BEGIN(lookup)
+#define KB_SCAN_LOOKUP_END()   PROF_END(PROF_KB_LOOKUP, lookup)
+#include "keymap/kb_scan.h"
 
 static const char *TAG = "kb-task";
 
 volatile bool is_caplk_on = false;
 static bool is_fn_locked = 0;
 
-#define COL_NUM 8
-#define ROW_NUM 16
+static keyboard_stats_t kb_stats;
+static portMUX_TYPE kb_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Log the delay from posting a report to the host polling it, periodically.
+// Compare with and without CONFIG_TINYUSB_HID_SOF_SYNC. With
+// CONFIG_TINYUSB_TASK_STATS, log the TinyUSB task latency and load too.
+// #define KB_USB_STATS_LOG_INTERVAL_US 5000000
+
+// While the bus is suspended, look for a key down this often
+#define KB_SUSPEND_SCAN_MS 20
+
 // keyboard pin array
-static uint rowscan_pins[16] = {KB_ROW_0,  KB_ROW_1,  KB_ROW_2,  KB_ROW_3, KB_ROW_4,  KB_ROW_5,
+static uint rowscan_pins[ROW_NUM] = {KB_ROW_0,  KB_ROW_1,  KB_ROW_2,  KB_ROW_3, KB_ROW_4,  KB_ROW_5,
                                 KB_ROW_6,  KB_ROW_7,  KB_ROW_8,  KB_ROW_9, KB_ROW_10, KB_ROW_11,
                                 KB_ROW_12, KB_ROW_13, KB_ROW_14, KB_ROW_15};
-static uint colscan_pins[8] = {KB_COL_0, KB_COL_1, KB_COL_2, KB_COL_3,
+static uint colscan_pins[COL_NUM] = {KB_COL_0, KB_COL_1, KB_COL_2, KB_COL_3,
                                KB_COL_4, KB_COL_5, KB_COL_6, KB_COL_7};
 
 void init_kb_matrix() {
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < COL_NUM; i++) {
         GPIO_INIT_OUT_PULLUP(colscan_pins[i]);
     }
-    for (int i = 0; i < 16; i++) {
+    for (int i = 0; i < ROW_NUM; i++) {
         GPIO_INIT_IN_PULLUP(rowscan_pins[i]);
     }
     GPIO_INIT_IN_PULLUP(BUTTON_FN);
@@ -48,120 +70,164 @@ static void kb_set_column_scan(int n) {
         gpio_set_level(colscan_pins[i], i != n);
     }
 }
+/**
+ * Check all the columns at once for a key down, for the low-power scan.
+ * Leaves all the columns driven low until the next kb_set_column_scan().
+ */
+static bool kb_is_any_key_down(void) {
+    for (int i = 0; i < COL_NUM; i++) {
+        gpio_set_level(colscan_pins[i], 0);
+    }
+    for (int row = 0; row < ROW_NUM; row++) {
+        if (gpio_get_level(rowscan_pins[row]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void do_fnfunc(fn_function_t fncode) {}
+
+/**
+ * Count a scan.
+ * @param start time of the first column
+ * @param last_start of the scan before, 0 if scanning was paused since
+ */
+static void update_scan_stats(int64_t start, int64_t last_start) {
+    uint32_t scan_us = esp_timer_get_time() - start;
+    taskENTER_CRITICAL(&kb_stats_lock);
+    kb_stats.scans++;
+    if (last_start != 0) {
+        uint32_t interval = start - last_start;
+        kb_stats.intervals++;
+        kb_stats.interval_us_sum += interval;
+        if (interval > kb_stats.interval_max_us) {
+            kb_stats.interval_max_us = interval;
+        }
+    }
+    if (scan_us > kb_stats.scan_max_us) {
+        kb_stats.scan_max_us = scan_us;
+    }
+    taskEXIT_CRITICAL(&kb_stats_lock);
+}
+
+void keyboard_get_stats(keyboard_stats_t *stats) {
+    taskENTER_CRITICAL(&kb_stats_lock);
+    *stats = kb_stats;
+    taskEXIT_CRITICAL(&kb_stats_lock);
+}
+
+#ifdef KB_USB_STATS_LOG_INTERVAL_US
+static void log_usb_stats(void) {
+    static int64_t last_log = 0;
+    int64_t now = esp_timer_get_time();
+    if (now - last_log < KB_USB_STATS_LOG_INTERVAL_US) {
+        return;
+    }
+    last_log = now;
+    tinyusb_hid_stats_t s;
+    tinyusb_hid_get_stats(&s);
+    for (int i = 0; i < 2; i++) {
+        if (s.polled[i] > 0) {
+            TLOGI(TAG, "%s: %" PRIu32 " reports polled, delay avg %" PRIu32 " us, max %" PRIu32
+                  " us",
+                  i == 0 ? "keyboard" : "pointer", s.polled[i],
+                  (uint32_t)(s.poll_delay_us_sum[i] / s.polled[i]), s.poll_delay_us_max[i]);
+        }
+    }
+#if CONFIG_TINYUSB_TASK_STATS
+    static tusb_task_stats_t last;
+    tusb_task_stats_t t;
+    if (tusb_get_task_stats(&t) == ESP_OK && t.probes > 0 && t.elapsed_us > last.elapsed_us) {
+        TLOGI(TAG, "tinyusb task: latency avg %" PRIu32 " us, max %" PRIu32 " us, cpu %" PRIu32
+              " permille",
+              (uint32_t)(t.latency_us_sum / t.probes), t.latency_us_max,
+              (uint32_t)((uint64_t)(t.run_time - last.run_time) * 1000 /
+                         (t.elapsed_us - last.elapsed_us)));
+        last = t;
+    }
+#endif
+}
+#endif
 void keyboard_task(void *arg) {
-    extern bool is_usb_connected;
     init_kb_matrix();
-    bool last_is_key_pressed = false;
-    uint64_t lasthid = 0;
-    uint16_t lasthotkey = 0;
-    fn_function_t lastfnfunc = FN_NOP;
+    kb_scan_t last;
+    kb_scan_begin(&last, false, false);
+    int64_t last_scan_us = 0;
     while (1) {
-        if (!is_usb_connected) {
-            vTaskDelay(2000);
-            ESP_LOGI(TAG, "Waiting usb connect...");
+        EventBits_t state = xEventGroupGetBits(usb_state);
+        if (!(state & USB_STATE_MOUNTED) ||
+            ((state & USB_STATE_SUSPENDED) && !(state & USB_STATE_WAKEUP_ALLOWED))) {
+            // nobody to report to, until the host mounts or resumes us
+            TLOGI(TAG, "Waiting usb connect...");
+            usb_state_wait(USB_STATE_ACTIVE);
+            last_scan_us = 0;
+            TLOGI(TAG, "Scanning %" PRId64 " us after usb connect",
+                  esp_timer_get_time() - usb_active_us);
             continue;
         }
-        bool is_key_pressed = false;
-        uint64_t hid = 0;
-        uint8_t *hidbuf = (uint8_t *)&hid;
-        int nr_hidkey = 0;
-        uint16_t hotkey = 0;
-        fn_function_t fnfunc = FN_NOP;
-        bool has_phantom_key = false;
-        uint32_t rows_connected = 0;
+        if (state & USB_STATE_SUSPENDED) {
+            // Low-power scan: nothing to do until a key goes down. Once one
+            // is, the full scan reports it as usual, which wakes the host up,
+            // and the scheduler keeps it until the host has resumed.
+            if (last.hid == 0 && last.hotkey == 0 && !kb_is_any_key_down()) {
+                vTaskDelay(pdMS_TO_TICKS(KB_SUSPEND_SCAN_MS));
+                last_scan_us = 0;
+                continue;
+            }
+        }
 
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+        // woken up by the frame timer just before the host polls, the timeout
+        // keeps scanning while there are no frames
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+#else
         vTaskDelay(pdMS_TO_TICKS(10));
+#endif
 
+        int64_t scan_us = esp_timer_get_time();
+        kb_scan_t scan;
+        kb_scan_begin(&scan, BUTTON_FN_STATE == 0, is_fn_locked);
+
+        PROF_BEGIN(scan);
         for (int col = 0; col < COL_NUM; col++) {
             kb_set_column_scan(col);
             uint32_t rows_cur_col = 0;  // rows connected with the current col
             for (int row = 0; row < ROW_NUM; row++) {
                 if (gpio_get_level(rowscan_pins[row]) == 0) {
                     rows_cur_col |= 1 << row;
-                    int hidkey = search_hid_key(col, row);
-                    if (hidkey > 0) {
-                        if (BUTTON_FN_STATE != 0) {
-                            // if (true) {
-                            // normal keyboard usage
-                            if (hidkey >= KEY_LEFTCTRL && hidkey <= KEY_RIGHTMETA) {
-                                hidbuf[0] |= 1u << (hidkey & 0x07);
-                            } else if (is_fn_locked && hidkey >= KEY_F1 && hidkey <= KEY_F12) {
-                                fn_keytable_t *fnitem = search_fn(col, row);
-                                if (fnitem != NULL) {
-                                    is_key_pressed = true;
-                                    hotkey = fnitem->hidcode;
-                                    fnfunc = fnitem->fncode;
-                                    hid = 0;  // clear keyboard key
-                                }
-                            } else if (nr_hidkey < 6) {
-                                hidbuf[2 + nr_hidkey] = hidkey;
-                                nr_hidkey++;
-                                is_key_pressed = true;
-                                hotkey = 0;  // clear hotkey
-                            }
-                        } else {
-                            if (is_fn_locked && hidkey >= KEY_F1 && hidkey <= KEY_F12) {
-                                if (!is_key_pressed) {
-                                    hidbuf[2] = hidkey;
-                                    is_key_pressed = true;
-                                    hotkey = 0;
-                                }
-                            } else {
-                                // hotkey
-                                fn_keytable_t *fnitem = search_fn(col, row);
-                                if (fnitem != NULL && nr_hidkey < 6) {
-                                    // is_key_pressed = true;
-                                    // hotkey = fnitem->hidcode;
-                                    // fnfunc = fnitem->fncode;
-                                    // hid = 0;  // clear keyboard key
-                                    hidbuf[2 + nr_hidkey] = fnitem->fncode;
-                                    nr_hidkey++;
-                                    is_key_pressed = true;
-                                    hotkey = 0;  // clear hotkey
-                                }
-                            }
-                        }
-                    }
                 }
             }
-            // rows that are connected by both current col and previous cols, which
-            // lead to "phantom keys" if more than one.
-            uint32_t rows_connected_again = rows_cur_col & rows_connected;
-            // If and only if less than two bits is 1, the following expr will be 0
-            if (rows_connected_again & (rows_connected_again - 1)) has_phantom_key = true;
-            rows_connected |= rows_cur_col;
+            kb_scan_column(&scan, col, rows_cur_col);
             // poll_trackpoint(get_kb_scan_interval_us());
         }
-        if (has_phantom_key) {
-            hotkey = lasthotkey;
-            fnfunc = lastfnfunc;
-            hid = lasthid;
-            is_key_pressed = last_is_key_pressed;
-        }
-        last_is_key_pressed = is_key_pressed;
+        PROF_END(PROF_KB_SCAN, scan);
+        // let the trackpoint task know without reading our GPIOs
+        atomic_store_explicit(&pointer_kb_flags, scan.kb_flags, memory_order_relaxed);
 
-        if (hid != lasthid) {
-            // printf("%02x %02x %02x %02x %02x %02x %02x %02x\n", hidbuf[0], hidbuf[1], hidbuf[2],
-            //        hidbuf[3], hidbuf[4], hidbuf[5], hidbuf[6], hidbuf[7]);
-            if (is_usb_connected) {
-                tinyusb_hid_keyboard_report(hidbuf);
-            }
-        }
-        lasthid = hid;
+        kb_scan_end(&scan, &last);
 
-        if (hotkey != lasthotkey) {
-            // printf("%04x\n", hotkey);
-            if (is_usb_connected) {
-                tinyusb_hid_consumer_report(hotkey);
-            }
+        PROF_BEGIN(report);
+        // a state refused by the scheduler is posted again on the next scan
+        if (scan.hid != last.hid && !tinyusb_hid_keyboard_report((uint8_t *)&scan.hid)) {
+            scan.hid = last.hid;
+        }
+        if (scan.hotkey != last.hotkey && !tinyusb_hid_consumer_report(scan.hotkey)) {
+            scan.hotkey = last.hotkey;
         }
-        lasthotkey = hotkey;
+        PROF_END(PROF_KB_REPORT, report);
 
-        if (fnfunc != lastfnfunc) {
-            do_fnfunc(fnfunc);
+        if (scan.fnfunc != last.fnfunc) {
+            do_fnfunc(scan.fnfunc);
         }
-        lastfnfunc = fnfunc;
+        last = scan;
+
+        update_scan_stats(scan_us, last_scan_us);
+        last_scan_us = scan_us;
+
+#ifdef KB_USB_STATS_LOG_INTERVAL_US
+        log_usb_stats();
+#endif
     }
 }
 
@@ -0,0 +1,48 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Keyboard matrix
+ */
+#ifndef MY_KEYBOARD_H
+#define MY_KEYBOARD_H
+
+#include <stdint.h>
+
+/**
+ * Matrix scan statistics, since boot
+ */
+typedef struct {
+    uint32_t scans;             // full scans of the matrix
+    uint32_t intervals;         // from one scan to the next, while scanning continuously
+    uint32_t interval_max_us;
+    uint64_t interval_us_sum;
+    uint32_t scan_max_us;       // longest scan, from the first column to the report
+} keyboard_stats_t;
+
+void keyboard_get_stats(keyboard_stats_t *stats);
+
+/**
+ * keyboard task
+ */
+void keyboard_task(void *arg);
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Keyboard matrix scan kernel: the key lookup, the boot report and consumer
+ * report building, and the phantom key check, one column at a time. Plain C
+ * without the GPIO reads, so that the benchmarks run what keyboard_task()
+ * runs, on the host too.
+ *
+ *     kb_scan_t scan;
+ *     kb_scan_begin(&scan, fn_down, fn_locked);
+ *     for (int col = 0; col < COL_NUM; col++) {
+ *         kb_scan_column(&scan, col, <rows closed on col>);
+ *     }
+ *     kb_scan_end(&scan, &last);
+ */
+
+#ifndef MY_KB_SCAN_H
+#define MY_KB_SCAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "keymap.h"
+#include "pointer.h"
+
+#define COL_NUM 8
+#define ROW_NUM 16
+
+// Defined by keyboard.c to time each key lookup with the profiler
+#ifndef KB_SCAN_LOOKUP_BEGIN
+#define KB_SCAN_LOOKUP_BEGIN()
+#define KB_SCAN_LOOKUP_END()
+#endif
+
+typedef struct {
+    uint64_t hid;            // boot keyboard report, modifiers in byte 0, keys in bytes 2-7
+    int nr_hidkey;           // keys in the report
+    bool is_key_pressed;
+    uint16_t hotkey;         // consumer usage, 0 if none
+    fn_function_t fnfunc;
+    uint32_t kb_flags;       // POINTER_KB_*
+    bool fn_down;            // Fn held during the scan
+    bool fn_locked;
+    uint32_t rows_connected; // rows closed on any column so far
+    bool has_phantom_key;
+} kb_scan_t;
+
+/**
+ * Start a scan with no key down.
+ * @param s scan
+ * @param fn_down Fn held
+ * @param fn_locked F1-F12 are the Fn row without Fn
+ */
+static inline void kb_scan_begin(kb_scan_t *s, bool fn_down, bool fn_locked) {
+    *s = (kb_scan_t){
+        .fnfunc = FN_NOP,
+        .kb_flags = fn_down ? POINTER_KB_FN : 0,
+        .fn_down = fn_down,
+        .fn_locked = fn_locked,
+    };
+}
+
+/**
+ * Add the keys down on one column.
+ * @param s scan
+ * @param col column
+ * @param rows rows closed on the column, bit n for row n
+ */
+static inline void kb_scan_column(kb_scan_t *s, int col, uint32_t rows) {
+    uint8_t *hidbuf = (uint8_t *)&s->hid;
+    for (uint32_t left = rows; left != 0; left &= left - 1) {
+        int row = __builtin_ctz(left);
+        KB_SCAN_LOOKUP_BEGIN();
+        int hidkey = search_hid_key(col, row);
+        KB_SCAN_LOOKUP_END();
+        if (hidkey <= 0) {
+            continue;
+        }
+        if (!s->fn_down) {
+            // normal keyboard usage
+            if (hidkey >= KEY_LEFTCTRL && hidkey <= KEY_RIGHTMETA) {
+                hidbuf[0] |= 1u << (hidkey & 0x07);
+            } else if (s->fn_locked && hidkey >= KEY_F1 && hidkey <= KEY_F12) {
+                fn_keytable_t *fnitem = search_fn(col, row);
+                if (fnitem != NULL) {
+                    s->is_key_pressed = true;
+                    s->hotkey = fnitem->hidcode;
+                    s->fnfunc = fnitem->fncode;
+                    s->hid = 0;  // clear keyboard key
+                }
+            } else if (s->nr_hidkey < 6) {
+                hidbuf[2 + s->nr_hidkey] = hidkey;
+                s->nr_hidkey++;
+                s->is_key_pressed = true;
+                s->hotkey = 0;  // clear hotkey
+            }
+        } else if (s->fn_locked && hidkey >= KEY_F1 && hidkey <= KEY_F12) {
+            if (!s->is_key_pressed) {
+                hidbuf[2] = hidkey;
+                s->is_key_pressed = true;
+                s->hotkey = 0;
+            }
+        } else {
+            // hotkey
+            fn_keytable_t *fnitem = search_fn(col, row);
+            if (fnitem != NULL && fnitem->fncode == FN_PRECISION) {
+                s->kb_flags |= POINTER_KB_PRECISION;
+            } else if (fnitem != NULL && s->nr_hidkey < 6) {
+                hidbuf[2 + s->nr_hidkey] = fnitem->fncode;
+                s->nr_hidkey++;
+                s->is_key_pressed = true;
+                s->hotkey = 0;  // clear hotkey
+            }
+        }
+    }
+    // rows that are connected by both current col and previous cols, which
+    // lead to "phantom keys" if more than one.
+    uint32_t rows_connected_again = rows & s->rows_connected;
+    // If and only if less than two bits is 1, the following expr will be 0
+    if (rows_connected_again & (rows_connected_again - 1)) s->has_phantom_key = true;
+    s->rows_connected |= rows;
+}
+
+/**
+ * Finish a scan: with a phantom key, the reports of the last scan stand.
+ * @param s scan
+ * @param last previous scan, as finished
+ */
+static inline void kb_scan_end(kb_scan_t *s, const kb_scan_t *last) {
+    if (s->has_phantom_key) {
+        s->hid = last->hid;
+        s->hotkey = last->hotkey;
+        s->fnfunc = last->fnfunc;
+        s->is_key_pressed = last->is_key_pressed;
+    }
+}
+
+#endif
@@ -377,6 +377,7 @@ typedef enum {
   FN_NOP = 0,
   FN_FNLOCK, 
   FN_BACKLIGHT,
+  FN_PRECISION,  // slow cursor while held
 } fn_function_t;
 
 /**
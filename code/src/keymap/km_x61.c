@@ -142,6 +142,7 @@ keytable_t kbtbl[] = {
 
 fn_keytable_t fntbl[] = {
     {0, 1, 0, FN_FNLOCK},
+    {7, 2, 0, FN_PRECISION},  // Fn + Space
     // { 7,  4, KEY_CONSUMER_MUTE, FN_NOP  },
     // { 7,  3, KEY_CONSUMER_VOLUME_DECREMENT, FN_NOP  },
     // { 1,  3, KEY_CONSUMER_VOLUME_INCREMENT, FN_NOP  },
@@ -0,0 +1,230 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Log ring
+ *
+ * The ring is an array of lines. A producer reserves the next line by
+ * moving the head with a compare and swap, formats into it, then marks it
+ * ready. The drain task, the only consumer, writes the ready lines in order
+ * and moves the tail, which frees them for the producers. No lock is taken,
+ * so a task logging on one core never waits for one on the other.
+ */
+
+#include "log_ring.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "task_cfg.h"
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+// Lines in the ring, a power of 2
+#define LOG_RING_LINES 64
+// Longer lines are cut, and end with a '\n' still
+#define LOG_LINE_MAX 128
+// Drain this often at least, when a producer could not wake the task up
+#define LOG_DRAIN_MS 20
+
+typedef struct {
+    // 0 while free or being written, length + 1 once ready
+    _Atomic uint32_t state;
+    char text[LOG_LINE_MAX];
+} log_line_t;
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+static log_line_t ring[LOG_RING_LINES];
+// next line to reserve, and next line to write out
+static _Atomic uint32_t ring_head = 0;
+static _Atomic uint32_t ring_tail = 0;
+static _Atomic uint32_t ring_dropped = 0;
+
+static uint32_t ring_lines = 0;
+static uint32_t ring_max_used = 0;
+
+static TaskHandle_t log_task_handle = NULL;
+static StaticTask_t log_task_tcb;
+static StackType_t log_task_stack[LOG_TASK_STACK];
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+static void log_ring_drain(void) {
+    uint32_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    if (head - tail > ring_max_used) {
+        ring_max_used = head - tail;
+    }
+    bool written = false;
+    while (tail != head) {
+        log_line_t *line = &ring[tail % LOG_RING_LINES];
+        uint32_t state = atomic_load_explicit(&line->state, memory_order_acquire);
+        if (state == 0) {
+            // still being formatted, and the ones after it wait
+            break;
+        }
+        fwrite(line->text, 1, state - 1, stdout);
+        atomic_store_explicit(&line->state, 0, memory_order_relaxed);
+        atomic_store_explicit(&ring_tail, ++tail, memory_order_release);
+        ring_lines++;
+        written = true;
+    }
+
+    static uint32_t dropped_shown = 0;
+    uint32_t dropped = atomic_load_explicit(&ring_dropped, memory_order_relaxed);
+    if (dropped != dropped_shown) {
+        printf("... %" PRIu32 " log lines dropped\n", dropped - dropped_shown);
+        dropped_shown = dropped;
+        written = true;
+    }
+    if (written) {
+        fflush(stdout);
+    }
+}
+
+/**
+ * Take the next free line.
+ * @param head set to the line taken
+ * @param tail set to the first line still waiting then
+ * @return the line, NULL if the ring is full
+ */
+static log_line_t *ring_reserve(uint32_t *head, uint32_t *tail) {
+    uint32_t h = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    uint32_t t;
+    do {
+        t = atomic_load_explicit(&ring_tail, memory_order_acquire);
+        if (h - t >= LOG_RING_LINES) {
+            atomic_fetch_add_explicit(&ring_dropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&ring_head, &h, h + 1, memory_order_acquire,
+                                                    memory_order_relaxed));
+    *head = h;
+    *tail = t;
+    return &ring[h % LOG_RING_LINES];
+}
+
+/**
+ * Hand a line taken by ring_reserve() over to the log task
+ */
+static void ring_commit(log_line_t *line, int len, uint32_t head, uint32_t tail) {
+    atomic_store_explicit(&line->state, len + 1, memory_order_release);
+    // the task only sleeps while the ring is empty
+    if (head == tail && log_task_handle != NULL && !xPortInIsrContext()) {
+        xTaskNotifyGive(log_task_handle);
+    }
+}
+
+static void log_ring_task(void *arg) {
+    (void)arg;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_DRAIN_MS));
+        log_ring_drain();
+    }
+}
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+int log_ring_vprintf(const char *fmt, va_list args) {
+    uint32_t head, tail;
+    log_line_t *line = ring_reserve(&head, &tail);
+    if (line == NULL) {
+        return 0;
+    }
+    int len = vsnprintf(line->text, LOG_LINE_MAX, fmt, args);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= LOG_LINE_MAX) {
+        len = LOG_LINE_MAX - 1;
+        line->text[len - 1] = '\n';
+    }
+    ring_commit(line, len, head, tail);
+    return len;
+}
+
+int log_ring_write(const char *text, int len) {
+    uint32_t head, tail;
+    log_line_t *line = ring_reserve(&head, &tail);
+    if (line == NULL) {
+        return 0;
+    }
+    // cut as log_ring_vprintf() does, keeping the end of the line
+    bool is_cut = len >= LOG_LINE_MAX;
+    if (len < 0) {
+        len = 0;
+    } else if (is_cut) {
+        len = LOG_LINE_MAX - 1;
+    }
+    memcpy(line->text, text, len);
+    if (is_cut) {
+        line->text[len - 1] = '\n';
+    }
+    line->text[len] = '\0';
+    ring_commit(line, len, head, tail);
+    return len;
+}
+
+int log_ring_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = log_ring_vprintf(fmt, args);
+    va_end(args);
+    return len;
+}
+
+void log_ring_start(void) {
+    if (log_task_handle != NULL) {
+        return;
+    }
+    log_task_handle = xTaskCreateStaticPinnedToCore(&log_ring_task, "log_task", LOG_TASK_STACK,
+                                                    NULL, LOG_TASK_PRIORITY, log_task_stack,
+                                                    &log_task_tcb, LOG_TASK_CORE);
+    esp_log_set_vprintf(log_ring_vprintf);
+}
+
+void log_ring_get_stats(log_ring_stats_t *stats) {
+    stats->lines = ring_lines;
+    stats->dropped = atomic_load_explicit(&ring_dropped, memory_order_relaxed);
+    stats->max_used = ring_max_used;
+}
@@ -0,0 +1,66 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Log ring
+ *
+ * ESP_LOG and log_ring_printf() format the line into a ring of lines, and a
+ * task of low priority writes them to the console. A task logging never
+ * waits for the console, when the ring is full the line is dropped and
+ * counted instead.
+ */
+#ifndef MY_LOG_RING_H
+#define MY_LOG_RING_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+typedef struct {
+    uint32_t lines;    // written to the console
+    uint32_t dropped;  // the ring was full
+    uint32_t max_used; // most lines waiting at once
+} log_ring_stats_t;
+
+/**
+ * Start the task draining the ring, and take over the output of ESP_LOG
+ */
+void log_ring_start(void);
+
+/**
+ * Like vprintf(), to the ring. Safe from any task, not from interrupts.
+ * @return length of the line, 0 if dropped
+ */
+int log_ring_vprintf(const char *fmt, va_list args);
+
+int log_ring_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Put a line already formatted to the ring, cut to the length of a line.
+ * A cut line keeps its '\n'.
+ * @param text the line, ending with a '\n'
+ * @param len length of text, a negative one writes an empty line
+ * @return length written, 0 if dropped
+ */
+int log_ring_write(const char *text, int len);
+
+void log_ring_get_stats(log_ring_stats_t *stats);
+
+#endif
@@ -8,34 +8,96 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
+#include "heap_guard.h"
+#include "keyboard.h"
 #include "keymap/keymap.h"
+#include "log_ring.h"
 #include "pin_cfg.h"
+#include "sampler.h"
 #include "sdkconfig.h"
+#include "stats_console.h"
+#include "task_cfg.h"
+#include "task_monitor.h"
 #include "tinyusb.h"
+#include "tlog.h"
+#include "trackpoint.h"
 #include "tusb.h"
 #include "tusb_hid.h"
+#include "usb_state.h"
 
 static const char *TAG = "kb-main";
 
-volatile bool is_usb_connected = false;
+// Print the run time of the tasks periodically, see task_monitor.c for the
+// measurement mode. Prints the profiles of prof.h and sampler.h too.
+// #define USE_TASK_MONITOR
+
+#if defined(USE_SAMPLER) && !defined(USE_TASK_MONITOR)
+#warning "USE_SAMPLER without USE_TASK_MONITOR: the samples are only dumped by the console"
+#endif
+
+EventGroupHandle_t usb_state = NULL;
+volatile int64_t usb_active_us = 0;
+static StaticEventGroup_t usb_state_buf;
+
+// Nothing is allocated from the heap after the boot, see heap_guard.c
+static StaticTask_t kb_task_tcb;
+static StackType_t kb_task_stack[KB_TASK_STACK];
+static StaticTask_t tp_task_tcb;
+static StackType_t tp_task_stack[TP_TASK_STACK];
+
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+// USB full speed frame
+#define USB_FRAME_US 1000
+// Wake the input tasks this long before the next frame starts, enough to
+// sample and get the report armed by the TinyUSB task before the host polls
+#define SOF_SYNC_LEAD_US 250
+// matrix scan period, in frames
+#define SOF_SYNC_SCAN_FRAMES 10
+
+static TaskHandle_t kb_task_handle = NULL;
+static esp_timer_handle_t frame_timer = NULL;
+static uint32_t frame_count = 0;
+
+static void on_frame_timer(void *arg) {
+    (void)arg;
+    if (++frame_count % SOF_SYNC_SCAN_FRAMES == 0 && kb_task_handle != NULL) {
+        xTaskNotifyGive(kb_task_handle);
+    }
+    trackpoint_frame_sync();
+}
+
+static void init_frame_timer(void) {
+    const esp_timer_create_args_t args = {.callback = on_frame_timer, .name = "usb_frame"};
+    ESP_ERROR_CHECK(esp_timer_create(&args, &frame_timer));
+}
+#endif
 
 static void init_usb(void) {
-    ESP_LOGI(TAG, "USB initialization");
+    TLOGI(TAG, "USB initialization");
 
     // Setting of descriptor. You can use descriptor_tinyusb and
     // descriptor_str_tinyusb as a reference
     tusb_desc_device_t my_descriptor = {.bLength = sizeof(my_descriptor),
                                         .bDescriptorType = TUSB_DESC_DEVICE,
                                         .bcdUSB = 0x0200,  // USB version. 0x0200 means version 2.0
+#if CFG_TUD_CDC
+                                        // the stats console is a CDC function, grouped by an IAD
+                                        .bDeviceClass = TUSB_CLASS_MISC,
+                                        .bDeviceSubClass = MISC_SUBCLASS_COMMON,
+                                        .bDeviceProtocol = MISC_PROTOCOL_IAD,
+#else
                                         .bDeviceClass = TUSB_CLASS_UNSPECIFIED,
+#endif
                                         .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
 
                                         .idVendor = 0x303A,
-                                        .idProduct = 0x3000,
+                                        // the host keeps the driver by PID, a new interface layout needs a new one
+                                        .idProduct = 0x3002,
                                         .bcdDevice = 0x0101,  // Device FW version
 
                                         .iManufacturer = 0x01,  // see string_descriptor[1] bellow
@@ -63,7 +125,7 @@ static void init_usb(void) {
     };
 
     ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
-    ESP_LOGI(TAG, "USB initialization DONE");
+    TLOGI(TAG, "USB initialization DONE");
 }
 
 void init_log() {
@@ -71,20 +133,43 @@ void init_log() {
     esp_log_set_vprintf(esp_apptrace_vprintf);
     esp_log_set_vprintf(vprintf);
     esp_apptrace_flush(ESP_APPTRACE_DEST_TRAX, 100000 /*tmo in us*/);
-    ESP_LOGI(TAG, "Tracing is finished.");
+    TLOGI(TAG, "Tracing is finished.");
+    // from now on, logging never waits for the console
+    log_ring_start();
 }
 
 void app_main() {
     init_log();
 
-    ESP_LOGI("app_main", "init_usb\n");
-    init_usb();
+    // before the TinyUSB task can call back
+    usb_state = xEventGroupCreateStatic(&usb_state_buf);
 
-    void keyboard_task(void *arg);
-    xTaskCreate(&keyboard_task, "kb_task", 4096, NULL, configMAX_PRIORITIES, NULL);
+    TLOGI("app_main", "init_usb\n");
+    init_usb();
 
-    void trackpoint_task(void *arg);
-    xTaskCreate(&trackpoint_task, "mouse_task", 4096, NULL, configMAX_PRIORITIES, NULL);
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+    init_frame_timer();
+    kb_task_handle =
+        xTaskCreateStaticPinnedToCore(&keyboard_task, "kb_task", KB_TASK_STACK, NULL,
+                                      KB_TASK_PRIORITY, kb_task_stack, &kb_task_tcb, KB_TASK_CORE);
+#else
+    xTaskCreateStaticPinnedToCore(&keyboard_task, "kb_task", KB_TASK_STACK, NULL, KB_TASK_PRIORITY,
+                                  kb_task_stack, &kb_task_tcb, KB_TASK_CORE);
+#endif
+
+    trackpoint_init();
+    xTaskCreateStaticPinnedToCore(&trackpoint_task, "mouse_task", TP_TASK_STACK, NULL,
+                                  TP_TASK_PRIORITY, tp_task_stack, &tp_task_tcb, TP_TASK_CORE);
+
+#ifdef USE_TASK_MONITOR
+    task_monitor_start();
+#endif
+#ifdef USE_SAMPLER
+    // dumped by the task monitor
+    sampler_start(SAMPLER_HZ);
+#endif
+    stats_console_start();
+    heap_guard_arm();
 }
 
 /****************************************************************
@@ -95,24 +180,46 @@ void app_main() {
 
 // tinyusb callbacks for connection
 void tud_mount_cb(void) {
-    is_usb_connected = true;
-    printf("USB connected.\n");
+    usb_active_us = esp_timer_get_time();
+    tinyusb_hid_mount();
+    xEventGroupClearBits(usb_state, USB_STATE_SUSPENDED | USB_STATE_WAKEUP_ALLOWED);
+    xEventGroupSetBits(usb_state, USB_STATE_MOUNTED | USB_STATE_ACTIVE);
+    TLOGI(TAG, "USB connected.");
 }
 
 // tinyusb callbacks for disconnection
 void tud_umount_cb(void) {
-    is_usb_connected = false;
-    printf("USB disconnected\n");
+    xEventGroupClearBits(usb_state, USB_STATE_MOUNTED | USB_STATE_ACTIVE | USB_STATE_SUSPENDED |
+                                        USB_STATE_WAKEUP_ALLOWED);
+    TLOGI(TAG, "USB disconnected");
 }
 
 void tud_suspend_cb(bool remote_wakeup_en) {
-    (void)remote_wakeup_en;
-    is_usb_connected = false;
-    // printf("USB suspended, %s\n");
-    printf("%s(%s)\n", __func__, remote_wakeup_en ? "true" : "false");
+    // keep scanning, a key press wakes the host up if it allows
+    xEventGroupClearBits(usb_state, USB_STATE_ACTIVE |
+                                        (remote_wakeup_en ? 0 : USB_STATE_WAKEUP_ALLOWED));
+    xEventGroupSetBits(usb_state,
+                       USB_STATE_SUSPENDED | (remote_wakeup_en ? USB_STATE_WAKEUP_ALLOWED : 0));
+    TLOGI(TAG, "%s(%s)", __func__, remote_wakeup_en ? "true" : "false");
+}
+
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+// Called by the TinyUSB task on each start of frame
+void tinyusb_hid_sof_cb(int64_t sof_us) {
+    int64_t delay = sof_us + USB_FRAME_US - SOF_SYNC_LEAD_US - esp_timer_get_time();
+    if (frame_timer != NULL && delay > 0) {
+        esp_timer_stop(frame_timer);
+        esp_timer_start_once(frame_timer, delay);
+    }
 }
+#endif
 
 void tud_resume_cb(void) {
-    is_usb_connected = true;
-    printf("%s\n", __func__);
+    usb_active_us = esp_timer_get_time();
+    xEventGroupClearBits(usb_state, USB_STATE_SUSPENDED | USB_STATE_WAKEUP_ALLOWED);
+    if (tud_mounted()) {
+        xEventGroupSetBits(usb_state, USB_STATE_ACTIVE);
+    }
+    tinyusb_hid_resume();
+    TLOGI(TAG, "%s", __func__);
 }
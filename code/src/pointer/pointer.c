@@ -0,0 +1,403 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Pointer motion pipeline
+ */
+
+#include "pointer.h"
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+#define SCALE_TRACKPOINT_SPEED
+#define MOUSE_SCALE_MIN 1
+// Extra gain applied beyond MOUSE_SCALE_MIN, in Q8
+#define MOUSE_SCALE_GAIN_Q8 (2 * POINTER_Q8_ONE)
+
+// Precision profile: a quarter of the speed, without acceleration
+#define PRECISION_GAIN_Q8 (POINTER_Q8_ONE / 4)
+
+// Acceleration curve: out = |d| * base + max(|d| - threshold, 0) * accel
+typedef struct {
+    int32_t base_q8;
+    int32_t accel_q8;
+    int32_t threshold;
+} curve_t;
+
+// Scroll curve: detents = d * (SCROLL_GAIN + SCROLL_ACCEL * min(|d|, SCROLL_ACCEL_MAX))
+#define SCROLL_GAIN_Q8 (POINTER_Q8_ONE / 8)
+#define SCROLL_ACCEL_Q8 (POINTER_Q8_ONE / 32)
+#define SCROLL_ACCEL_MAX 32
+#define SCROLL_REPORT_MAX 127
+
+// Scroll curve while Fn or a layer key is held, same shape
+#define FN_SCROLL_GAIN_Q8 (POINTER_Q8_ONE / 4)
+#define FN_SCROLL_ACCEL_Q8 (POINTER_Q8_ONE / 16)
+#define FN_SCROLL_ACCEL_MAX 32
+
+// Adaptive filter: cutoff = FILTER_MIN_CUTOFF + FILTER_BETA * speed, the speed
+// being smoothed with FILTER_SPEED_CUTOFF. Frequencies in mHz, speed in count/s.
+#define FILTER_MIN_CUTOFF_MHZ   1000
+#define FILTER_BETA_MHZ         60
+#define FILTER_SPEED_CUTOFF_MHZ 5000
+// Longest step taken into account, after a pause
+#define FILTER_MAX_DT_US        100000
+
+// Stick travel while the middle button is held, beyond which it scrolls
+#define MIDKEY_SCROLL_THRESHOLD 2
+// Held longer than this without scrolling, the release is not a click
+#define MIDKEY_CLICK_TIMEOUT_US (300 * 1000)
+// How long the middle click is reported as pressed
+#define MIDKEY_CLICK_HOLD_US (20 * 1000)
+
+/****************************************************************
+ *
+ *  Public Varibles
+ *
+ ****************************************************************/
+
+_Atomic uint32_t pointer_kb_flags = 0;
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+static const curve_t curves[POINTER_PROFILE_MAX] = {
+#ifdef SCALE_TRACKPOINT_SPEED
+    // Scale the trackpoint mouse since it may be too slow...
+    [POINTER_PROFILE_NORMAL] = {POINTER_Q8_ONE, MOUSE_SCALE_GAIN_Q8, MOUSE_SCALE_MIN},
+#else
+    [POINTER_PROFILE_NORMAL] = {POINTER_Q8_ONE, 0, 0},
+#endif
+    [POINTER_PROFILE_PRECISION] = {PRECISION_GAIN_Q8, 0, 0},
+};
+
+static pointer_profile_t profiles[POINTER_PROFILE_MAX];
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+static int32_t scroll_curve(int32_t d, int32_t gain_q8, int32_t accel_q8, int32_t accel_max) {
+    int32_t speed = d < 0 ? -d : d;
+    if (speed > accel_max) speed = accel_max;
+    return d * (gain_q8 + accel_q8 * speed);
+}
+
+static int32_t clamp_i32(int32_t v, int32_t limit) {
+    return v > limit ? limit : v < -limit ? -limit : v;
+}
+
+/**
+ * Smoothing factor of a first order low-pass filter,
+ * alpha = 1 / (1 + tau / dt) with tau = 1 / (2 pi cutoff).
+ * @param cutoff_mhz cutoff frequency in mHz
+ * @param dt_us time step in microsecond
+ * @return alpha in Q8
+ */
+static int32_t lowpass_alpha_q8(int64_t cutoff_mhz, int64_t dt_us) {
+    // 2 pi cutoff dt, in 1e-9
+    int64_t k = 6283 * cutoff_mhz * dt_us / 1000;
+    return (int32_t)(k * POINTER_Q8_ONE / (k + 1000000000));
+}
+
+/**
+ * Pay back the motion extrapolated ahead of a packet.
+ * @param v motion of the packet, Q8
+ * @param debt extrapolated motion, reduced by what is paid back
+ * @return what is left of the packet
+ */
+static int32_t pay_debt(int32_t v, int32_t *debt) {
+    if ((v > 0 && *debt > 0) || (v < 0 && *debt < 0)) {
+        int32_t pay = v > 0 ? (v < *debt ? v : *debt) : (v > *debt ? v : *debt);
+        *debt -= pay;
+        return v - pay;
+    }
+    // the stick stopped or turned back, nothing is owed any more
+    *debt = 0;
+    return v;
+}
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+void pointer_accum_reset(pointer_accum_t *acc) { acc->x = acc->y = 0; }
+
+void pointer_profiles_init(void) {
+    for (int i = 0; i < POINTER_PROFILE_MAX; i++) {
+        const curve_t *c = &curves[i];
+        for (int32_t d = 0; d < POINTER_LUT_SIZE; d++) {
+            int32_t over = d > c->threshold ? d - c->threshold : 0;
+            profiles[i].lut[d] = d * c->base_q8 + over * c->accel_q8;
+        }
+        // the table already covers the threshold, the curve is a line beyond
+        profiles[i].slope_q8 = c->base_q8 + c->accel_q8;
+    }
+}
+
+const pointer_profile_t *pointer_profile(pointer_profile_id_t id) {
+    return &profiles[id < POINTER_PROFILE_MAX ? id : POINTER_PROFILE_NORMAL];
+}
+
+int32_t pointer_scale(const pointer_profile_t *p, int32_t d) {
+    int32_t mag = d < 0 ? -d : d;
+    int32_t out;
+    if (mag < POINTER_LUT_SIZE) {
+        out = p->lut[mag];
+    } else {
+        out = p->lut[POINTER_LUT_SIZE - 1] + (mag - (POINTER_LUT_SIZE - 1)) * p->slope_q8;
+    }
+    return d < 0 ? -out : out;
+}
+
+bool pointer_accum_take(pointer_accum_t *acc, int32_t x_q8, int32_t y_q8, int32_t limit,
+                        int16_t *out_x, int16_t *out_y) {
+    acc->x += x_q8;
+    acc->y += y_q8;
+
+    // Truncate toward zero, so that both directions need the same amount of
+    // motion before the first count comes out.
+    int32_t x = clamp_i32(acc->x / POINTER_Q8_ONE, limit);
+    int32_t y = clamp_i32(acc->y / POINTER_Q8_ONE, limit);
+    acc->x -= x * POINTER_Q8_ONE;
+    acc->y -= y * POINTER_Q8_ONE;
+
+    *out_x = (int16_t)x;
+    *out_y = (int16_t)y;
+    return x != 0 || y != 0;
+}
+
+uint8_t pointer_midkey_update(pointer_midkey_t *mk, bool pressed, int32_t dx, int32_t dy,
+                              int64_t now_us) {
+    switch (mk->state) {
+        case POINTER_MIDKEY_CLICK:
+            if (!pressed && now_us - mk->since_us < MIDKEY_CLICK_HOLD_US) {
+                return POINTER_MIDKEY_BUTTON_DOWN;
+            }
+            mk->state = POINTER_MIDKEY_IDLE;
+            // fall through
+        case POINTER_MIDKEY_IDLE:
+            if (!pressed) {
+                return 0;
+            }
+            mk->state = POINTER_MIDKEY_PENDING;
+            mk->since_us = now_us;
+            mk->travel = 0;
+            // fall through
+        case POINTER_MIDKEY_PENDING:
+            if (!pressed) {
+                if (now_us - mk->since_us < MIDKEY_CLICK_TIMEOUT_US) {
+                    mk->state = POINTER_MIDKEY_CLICK;
+                    mk->since_us = now_us;
+                    return POINTER_MIDKEY_BUTTON_DOWN;
+                }
+                mk->state = POINTER_MIDKEY_IDLE;
+                return 0;
+            }
+            mk->travel += (dx < 0 ? -dx : dx) + (dy < 0 ? -dy : dy);
+            if (mk->travel < MIDKEY_SCROLL_THRESHOLD) {
+                // hold the cursor still until we know what it is
+                return POINTER_MIDKEY_DROP_MOTION;
+            }
+            mk->state = POINTER_MIDKEY_SCROLL;
+            mk->since_us = now_us;
+            // fall through
+        case POINTER_MIDKEY_SCROLL:
+        default:
+            if (!pressed) {
+                mk->state = POINTER_MIDKEY_IDLE;
+                return 0;
+            }
+            return POINTER_MIDKEY_SCROLL_MOTION;
+    }
+}
+
+int32_t pointer_scroll_curve(int32_t d) {
+    return scroll_curve(d, SCROLL_GAIN_Q8, SCROLL_ACCEL_Q8, SCROLL_ACCEL_MAX);
+}
+
+int32_t pointer_fn_scroll_curve(int32_t d) {
+    return scroll_curve(d, FN_SCROLL_GAIN_Q8, FN_SCROLL_ACCEL_Q8, FN_SCROLL_ACCEL_MAX);
+}
+
+bool pointer_scroll_take(pointer_accum_t *acc, int32_t h_q8, int32_t v_q8, uint8_t multiplier,
+                         int8_t *out_h, int8_t *out_v) {
+    int16_t h, v;
+    bool ret = pointer_accum_take(acc, h_q8 * multiplier, v_q8 * multiplier, SCROLL_REPORT_MAX,
+                                  &h, &v);
+    acc->x %= POINTER_Q8_ONE;
+    acc->y %= POINTER_Q8_ONE;
+    *out_h = (int8_t)h;
+    *out_v = (int8_t)v;
+    return ret;
+}
+
+void pointer_filter_reset(pointer_filter_t *f) { f->x = f->y = f->speed = 0; }
+
+void pointer_filter_step(pointer_filter_t *f, int32_t x_q8, int32_t y_q8, int64_t dt_us,
+                         int32_t *out_x, int32_t *out_y) {
+    if (dt_us <= 0) dt_us = 1;
+    if (dt_us > FILTER_MAX_DT_US) dt_us = FILTER_MAX_DT_US;
+
+    // speed of the input, smoothed
+    int64_t speed = (int64_t)((x_q8 < 0 ? -x_q8 : x_q8) + (y_q8 < 0 ? -y_q8 : y_q8)) * 1000000 /
+                    (dt_us * POINTER_Q8_ONE);
+    f->speed += (speed - f->speed) * lowpass_alpha_q8(FILTER_SPEED_CUTOFF_MHZ, dt_us) /
+                POINTER_Q8_ONE;
+
+    // The filter runs on the position, what it holds back is the distance
+    // between the input and the filtered position, released on later steps.
+    f->x += x_q8;
+    f->y += y_q8;
+    int32_t alpha = lowpass_alpha_q8(FILTER_MIN_CUTOFF_MHZ + FILTER_BETA_MHZ * f->speed, dt_us);
+    *out_x = (int32_t)((int64_t)f->x * alpha / POINTER_Q8_ONE);
+    *out_y = (int32_t)((int64_t)f->y * alpha / POINTER_Q8_ONE);
+    f->x -= *out_x;
+    f->y -= *out_y;
+}
+
+void pointer_resample_reset(pointer_resample_t *r) {
+    *r = (pointer_resample_t){.period_us = 1};
+}
+
+void pointer_resample_push(pointer_resample_t *r, int32_t x_q8, int32_t y_q8, int64_t period_us,
+                           int64_t now_us) {
+    if (now_us > r->due_us + r->period_us) {
+        // a new stroke, nothing has been extrapolated for it
+        r->debt_x = r->debt_y = 0;
+        r->last_us = now_us;
+    }
+    r->x += pay_debt(x_q8, &r->debt_x);
+    r->y += pay_debt(y_q8, &r->debt_y);
+    r->vx = x_q8;
+    r->vy = y_q8;
+    r->period_us = period_us > 0 ? period_us : 1;
+    r->due_us = now_us + r->period_us;
+}
+
+bool pointer_resample_take(pointer_resample_t *r, int64_t now_us, bool extrapolate,
+                           int32_t *out_x, int32_t *out_y) {
+    int64_t last_us = r->last_us;
+    r->last_us = now_us;
+
+    if (now_us < r->due_us) {
+        // the share of the remaining time until due
+        int64_t dt = now_us - last_us, left = r->due_us - last_us;
+        *out_x = (int32_t)(r->x * dt / left);
+        *out_y = (int32_t)(r->y * dt / left);
+        r->x -= *out_x;
+        r->y -= *out_y;
+        return true;
+    }
+
+    *out_x = r->x;
+    *out_y = r->y;
+    r->x = r->y = 0;
+
+    int64_t end_us = r->due_us + r->period_us;
+    if (!extrapolate || last_us >= end_us) {
+        return false;
+    }
+    int64_t from = last_us > r->due_us ? last_us : r->due_us;
+    int64_t to = now_us < end_us ? now_us : end_us;
+    int32_t ex = (int32_t)(r->vx * (to - from) / r->period_us);
+    int32_t ey = (int32_t)(r->vy * (to - from) / r->period_us);
+    *out_x += ex;
+    *out_y += ey;
+    r->debt_x += ex;
+    r->debt_y += ey;
+    return now_us < end_us;
+}
+
+void pointer_pipeline_reset(pointer_pipeline_t *p, uint32_t options) {
+    *p = (pointer_pipeline_t){.options = options};
+    pointer_resample_reset(&p->resample);
+    pointer_filter_reset(&p->filter);
+    pointer_accum_reset(&p->motion);
+    pointer_accum_reset(&p->scroll);
+}
+
+bool pointer_pipeline_step(pointer_pipeline_t *p, const pointer_frame_in_t *in,
+                           pointer_frame_out_t *out) {
+    int32_t dx = in->dx, dy = in->dy;
+    *out = (pointer_frame_out_t){0};
+
+    // The middle button is resolved into click or scroll here, it has to run
+    // on every poll since a click is released some time after the last packet.
+    out->midkey = pointer_midkey_update(&p->midkey, in->middle, dx, dy, in->now_us);
+    // the precision key is pressed along with Fn, it is not a scroll
+    bool precision = in->kb_flags & POINTER_KB_PRECISION;
+    bool fn_pan = (p->options & POINTER_PIPELINE_FN_PAN) && !precision &&
+                  (in->kb_flags & (POINTER_KB_FN | POINTER_KB_LAYER));
+    if (fn_pan) {
+        pointer_scroll_take(&p->scroll, pointer_fn_scroll_curve(dx), pointer_fn_scroll_curve(-dy),
+                            in->multiplier, &out->pan, &out->wheel);
+        pointer_resample_reset(&p->resample);
+        p->busy = false;
+    } else if (out->midkey & POINTER_MIDKEY_SCROLL_MOTION) {
+        // middle key for pan, pushing the stick up scrolls up
+        pointer_scroll_take(&p->scroll, pointer_scroll_curve(dx), pointer_scroll_curve(-dy),
+                            in->multiplier, &out->pan, &out->wheel);
+        pointer_resample_reset(&p->resample);
+        p->busy = false;
+    } else if (out->midkey & POINTER_MIDKEY_DROP_MOTION) {
+        pointer_resample_reset(&p->resample);
+        p->busy = false;
+    } else {
+        pointer_accum_reset(&p->scroll);
+        int32_t mx = 0, my = 0;
+        if (in->is_recv) {
+            const pointer_profile_t *profile =
+                pointer_profile(precision ? POINTER_PROFILE_PRECISION : POINTER_PROFILE_NORMAL);
+            mx = pointer_scale(profile, dx);
+            my = pointer_scale(profile, dy);
+        }
+        out->packet_x = mx;
+        out->packet_y = my;
+        if (p->options & POINTER_PIPELINE_RESAMPLE) {
+            if (in->is_recv) {
+                pointer_resample_push(&p->resample, mx, my, in->period_us, in->now_us);
+            }
+            p->busy = pointer_resample_take(&p->resample, in->now_us,
+                                            p->options & POINTER_PIPELINE_EXTRAPOLATE, &mx, &my);
+        }
+        if (p->options & POINTER_PIPELINE_FILTER) {
+            pointer_filter_step(&p->filter, mx, my, in->now_us - p->filter_us, &mx, &my);
+            p->filter_us = in->now_us;
+        }
+        out->frame_x = mx;
+        out->frame_y = my;
+        if (mx != 0 || my != 0) {
+            pointer_accum_take(&p->motion, mx, my, in->xy_limit, &out->x, &out->y);
+        }
+    }
+    return p->busy;
+}
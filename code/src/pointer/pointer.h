@@ -0,0 +1,323 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Pointer motion pipeline, from raw trackpoint counts to HID report deltas.
+ *
+ * Everything here is plain C without any ESP-IDF dependency, all the
+ * arithmetic is fixed point in Q8 (1/256 count).
+ */
+
+#ifndef MY_POINTER_H
+#define MY_POINTER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define POINTER_Q8_ONE 256
+
+/**
+ * Keyboard state the pointer depends on, published by the keyboard task on
+ * every scan and read by the trackpoint task without any lock.
+ */
+#define POINTER_KB_FN        0x01  // Fn held
+#define POINTER_KB_LAYER     0x02  // a layer key held
+#define POINTER_KB_PRECISION 0x04  // precision key held
+
+extern _Atomic uint32_t pointer_kb_flags;
+
+/**
+ * Sub-pixel accumulator for one pair of axes.
+ * Holds the fractional part that has not been reported yet.
+ */
+typedef struct {
+    int32_t x, y;  // Q8
+} pointer_accum_t;
+
+/**
+ * Clear the sub-pixel remainder.
+ * @param acc accumulator
+ */
+void pointer_accum_reset(pointer_accum_t *acc);
+
+/**
+ * Pointer gain profiles.
+ *
+ * Each profile is an acceleration curve precomputed into a table by
+ * pointer_profiles_init(), so that switching between them is only a matter
+ * of passing another pointer to pointer_scale().
+ */
+typedef enum {
+    POINTER_PROFILE_NORMAL = 0,
+    POINTER_PROFILE_PRECISION,  // slow cursor for detailed work
+    POINTER_PROFILE_MAX,
+} pointer_profile_id_t;
+
+#define POINTER_LUT_SIZE 64
+
+typedef struct {
+    int32_t lut[POINTER_LUT_SIZE];  // scaled motion in Q8 for |d| = 0 .. POINTER_LUT_SIZE - 1
+    int32_t slope_q8;               // gain beyond the table, in Q8
+} pointer_profile_t;
+
+/**
+ * Build the tables of all the profiles, once before using any of them.
+ */
+void pointer_profiles_init(void);
+
+/**
+ * Get a profile.
+ * @param id profile
+ * @return profile for pointer_scale()
+ */
+const pointer_profile_t *pointer_profile(pointer_profile_id_t id);
+
+/**
+ * Scale the raw trackpoint counts.
+ * @param p gain profile
+ * @param d raw counts of one axis summed over one poll
+ * @return scaled motion in Q8
+ */
+int32_t pointer_scale(const pointer_profile_t *p, int32_t d);
+
+/**
+ * Feed Q8 motion into the accumulator and take the integer part out of it.
+ * Whatever is beyond [-limit, limit] or below one count is kept for the
+ * next report instead of being wrapped or dropped.
+ * @param acc accumulator
+ * @param x_q8 motion on X in Q8
+ * @param y_q8 motion on Y in Q8
+ * @param limit largest magnitude the report can carry
+ * @param out_x integer X to report
+ * @param out_y integer Y to report
+ * @return true if there is anything to report
+ */
+bool pointer_accum_take(pointer_accum_t *acc, int32_t x_q8, int32_t y_q8, int32_t limit,
+                        int16_t *out_x, int16_t *out_y);
+
+/**
+ * Adaptive low-pass filter, in the style of the 1 euro filter.
+ *
+ * The cutoff frequency rises with the speed of the stick: the jitter at rest
+ * and while aiming slowly is smoothed out, fast moves go through almost
+ * untouched. Nothing is lost, what is held back comes out on later steps.
+ */
+typedef struct {
+    int32_t x, y;   // input not output yet, Q8
+    int32_t speed;  // smoothed speed, in count/s
+} pointer_filter_t;
+
+/**
+ * Clear the filter, dropping what it holds back.
+ * @param f filter
+ */
+void pointer_filter_reset(pointer_filter_t *f);
+
+/**
+ * Run the filter one step, to be called on every poll even if the trackpoint
+ * has sent nothing, so that the motion held back keeps coming out.
+ * @param f filter
+ * @param x_q8 motion on X in Q8
+ * @param y_q8 motion on Y in Q8
+ * @param dt_us time since the previous step
+ * @param out_x filtered motion on X in Q8
+ * @param out_y filtered motion on Y in Q8
+ */
+void pointer_filter_step(pointer_filter_t *f, int32_t x_q8, int32_t y_q8, int64_t dt_us,
+                         int32_t *out_x, int32_t *out_y);
+
+/**
+ * Resampler, from the trackpoint packet rate to the USB polling rate.
+ *
+ * The motion of a packet is spread evenly over the time until the next one
+ * is expected, instead of being reported at once. Optionally, once that time
+ * is over, the motion goes on at the speed of the last packet for up to one
+ * more period, and what was added is taken off the next packet. If the stick
+ * was released meanwhile, the cursor overshoots by at most one packet.
+ */
+typedef struct {
+    int32_t x, y;            // motion not released yet, Q8
+    int32_t vx, vy;          // motion of the last packet, Q8
+    int32_t debt_x, debt_y;  // motion extrapolated ahead of the packets, Q8
+    int64_t last_us;         // last pointer_resample_take()
+    int64_t due_us;          // when x, y have to be released
+    int64_t period_us;       // expected packet interval
+} pointer_resample_t;
+
+/**
+ * Clear the resampler, dropping the motion it holds.
+ * @param r resampler
+ */
+void pointer_resample_reset(pointer_resample_t *r);
+
+/**
+ * Add the motion of a packet.
+ * @param r resampler
+ * @param x_q8 motion on X in Q8
+ * @param y_q8 motion on Y in Q8
+ * @param period_us expected interval until the next packet
+ * @param now_us current time in microsecond
+ */
+void pointer_resample_push(pointer_resample_t *r, int32_t x_q8, int32_t y_q8, int64_t period_us,
+                           int64_t now_us);
+
+/**
+ * Take the motion due by now, to be called on every USB frame.
+ * @param r resampler
+ * @param now_us current time in microsecond
+ * @param extrapolate go on at the last speed once the packet is released
+ * @param out_x motion on X in Q8
+ * @param out_y motion on Y in Q8
+ * @return true while there is motion left, i.e. the next frame is needed
+ */
+bool pointer_resample_take(pointer_resample_t *r, int64_t now_us, bool extrapolate,
+                           int32_t *out_x, int32_t *out_y);
+
+/**
+ * Middle button: click or scroll.
+ *
+ * Pressing the middle button and moving the stick scrolls. Releasing it
+ * quickly without scrolling is a middle click, whose press and release are
+ * spread over the following polls instead of sleeping in between.
+ */
+typedef enum {
+    POINTER_MIDKEY_IDLE = 0,
+    POINTER_MIDKEY_PENDING,  // pressed, not decided yet
+    POINTER_MIDKEY_SCROLL,   // pressed, motion is scroll
+    POINTER_MIDKEY_CLICK,    // released, middle click being reported
+} pointer_midkey_state_t;
+
+typedef struct {
+    pointer_midkey_state_t state;
+    int64_t since_us;  // when the current state was entered
+    int32_t travel;    // stick travel while pending
+} pointer_midkey_t;
+
+// pointer_midkey_update() result flags
+#define POINTER_MIDKEY_SCROLL_MOTION 0x01  // motion of this poll is scroll
+#define POINTER_MIDKEY_BUTTON_DOWN   0x02  // report the middle button as pressed
+#define POINTER_MIDKEY_DROP_MOTION   0x04  // motion of this poll is neither pointer nor scroll
+
+/**
+ * Advance the middle button state machine, to be called on every poll even
+ * if the trackpoint has sent nothing.
+ * @param mk state machine
+ * @param pressed middle button state from the trackpoint
+ * @param dx motion on X of this poll
+ * @param dy motion on Y of this poll
+ * @param now_us current time in microsecond
+ * @return POINTER_MIDKEY_* flags
+ */
+uint8_t pointer_midkey_update(pointer_midkey_t *mk, bool pressed, int32_t dx, int32_t dy,
+                              int64_t now_us);
+
+/**
+ * Map raw trackpoint counts to scroll distance.
+ * @param d raw counts of one axis summed over one poll
+ * @return scroll distance in Q8 wheel detents
+ */
+int32_t pointer_scroll_curve(int32_t d);
+
+/**
+ * Map raw trackpoint counts to scroll distance while Fn or a layer key is
+ * held, which scrolls with no button pressed and so can be made faster.
+ * @param d raw counts of one axis summed over one poll
+ * @return scroll distance in Q8 wheel detents
+ */
+int32_t pointer_fn_scroll_curve(int32_t d);
+
+/**
+ * Feed Q8 wheel detents into the accumulator and take high-resolution wheel
+ * units out of it, each one being 1/multiplier detent. The part below one
+ * unit is kept, whatever cannot fit in one report is dropped so that the
+ * page does not keep scrolling after the stick is released.
+ * @param acc accumulator, x for AC Pan and y for the wheel
+ * @param h_q8 horizontal scroll in Q8 detents
+ * @param v_q8 vertical scroll in Q8 detents
+ * @param multiplier resolution multiplier negotiated with the host
+ * @param out_h AC Pan to report
+ * @param out_v wheel to report
+ * @return true if there is anything to report
+ */
+bool pointer_scroll_take(pointer_accum_t *acc, int32_t h_q8, int32_t v_q8, uint8_t multiplier,
+                         int8_t *out_h, int8_t *out_v);
+
+/**
+ * Per-frame pipeline, as run by the trackpoint task on every poll: the
+ * middle button, the Fn scroll, then the gain profile, the resampler, the
+ * filter and the sub-pixel accumulator for the pointer motion.
+ */
+
+// pointer_pipeline_reset() options, the stages to run
+#define POINTER_PIPELINE_FN_PAN      0x01  // Fn or a layer key held scrolls
+#define POINTER_PIPELINE_RESAMPLE    0x02  // spread the packets over the frames
+#define POINTER_PIPELINE_EXTRAPOLATE 0x04  // with the resampler, go on at the last speed
+#define POINTER_PIPELINE_FILTER      0x08  // adaptive low-pass filter
+
+typedef struct {
+    uint32_t options;
+    pointer_midkey_t midkey;
+    pointer_resample_t resample;
+    pointer_filter_t filter;
+    int64_t filter_us;       // time of the last filter step
+    pointer_accum_t motion;  // pointer motion not reported yet
+    pointer_accum_t scroll;  // scroll not reported yet
+    bool busy;               // the resampler needs the next frame
+} pointer_pipeline_t;
+
+typedef struct {
+    int32_t dx, dy;        // raw counts of the packets read for this frame, Y down
+    bool is_recv;          // a packet was read
+    bool middle;           // middle button from the trackpoint
+    uint32_t kb_flags;     // POINTER_KB_*
+    int64_t period_us;     // expected interval until the next packet
+    int64_t now_us;
+    uint8_t multiplier;    // wheel resolution multiplier negotiated with the host
+    int32_t xy_limit;      // largest magnitude the report carries on X and Y
+} pointer_frame_in_t;
+
+typedef struct {
+    int16_t x, y;                // pointer motion to report
+    int8_t wheel, pan;           // scroll to report
+    uint8_t midkey;              // POINTER_MIDKEY_* flags
+    int32_t packet_x, packet_y;  // motion of the packet after the gain, Q8, for tracing
+    int32_t frame_x, frame_y;    // motion of the frame before the accumulator, Q8
+} pointer_frame_out_t;
+
+/**
+ * Clear the pipeline, dropping the motion it holds.
+ * @param p pipeline
+ * @param options POINTER_PIPELINE_* stages to run
+ */
+void pointer_pipeline_reset(pointer_pipeline_t *p, uint32_t options);
+
+/**
+ * Run the pipeline for one frame, to be called on every poll even if the
+ * trackpoint has sent nothing.
+ * @param p pipeline
+ * @param in input of the frame
+ * @param out what to report
+ * @return true while the resampler holds motion, i.e. the next frame is needed
+ */
+bool pointer_pipeline_step(pointer_pipeline_t *p, const pointer_frame_in_t *in,
+                           pointer_frame_out_t *out);
+
+#endif
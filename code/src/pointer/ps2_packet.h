@@ -0,0 +1,81 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * PS2 mouse packet decoding, the 3 byte stream mode packets of the
+ * trackpoint. Plain C like the rest of the pointer pipeline, so that the
+ * benchmarks run it on the host too.
+ *
+ * Byte 0: Y overflow, X overflow, Y sign, X sign, 1, middle, right, left
+ * Byte 1: X movement, low 8 bits
+ * Byte 2: Y movement, low 8 bits, up is positive
+ */
+
+#ifndef MY_PS2_PACKET_H
+#define MY_PS2_PACKET_H
+
+#include <stdint.h>
+
+#define PS2_PACKET_ALWAYS_1 0b00001000  // set in byte 0, never missing from a packet start
+#define PS2_PACKET_BUTTONS  0b00000111
+
+typedef struct {
+    uint8_t data[3];
+    uint8_t len;  // bytes received of the packet being assembled
+} ps2_packet_t;
+
+typedef enum {
+    PS2_PACKET_MORE = 0,     // packet not complete yet
+    PS2_PACKET_DONE,         // packet complete in data, len is back to 0
+    PS2_PACKET_OUT_OF_SYNC,  // byte dropped, it cannot start a packet
+} ps2_packet_result_t;
+
+/**
+ * Add one byte to the packet being assembled.
+ * A byte without PS2_PACKET_ALWAYS_1 cannot start a packet and is dropped to
+ * get back in sync.
+ * @param p packet
+ * @param b byte received
+ */
+static inline ps2_packet_result_t ps2_packet_feed(ps2_packet_t *p, uint8_t b) {
+    if (p->len == 0 && (b & PS2_PACKET_ALWAYS_1) == 0) {
+        return PS2_PACKET_OUT_OF_SYNC;
+    }
+    p->data[p->len++] = b;
+    if (p->len < 3) {
+        return PS2_PACKET_MORE;
+    }
+    p->len = 0;
+    return PS2_PACKET_DONE;
+}
+
+/**
+ * Motion of a complete packet, 9-bit two's complement with the sign bits in
+ * byte 0.
+ * @param p packet
+ * @param dx motion on X
+ * @param dy motion on Y, up is positive
+ */
+static inline void ps2_packet_motion(const ps2_packet_t *p, int16_t *dx, int16_t *dy) {
+    *dx = p->data[1] - ((p->data[0] << 4) & 0x100);
+    *dy = p->data[2] - ((p->data[0] << 3) & 0x100);
+}
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Hot path profiler
+ */
+
+#include "prof.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+static const char *TAG = "prof";
+
+#ifdef USE_PROF
+static const char *const prof_names[PROF_TOTAL] = {
+    [PROF_KB_SCAN] = "kb scan",         [PROF_KB_LOOKUP] = "kb lookup",
+    [PROF_KB_REPORT] = "kb report",     [PROF_TP_DECODE] = "tp decode",
+    [PROF_TP_POINTER] = "tp pointer",   [PROF_TP_REPORT] = "tp report",
+};
+
+static prof_stats_t prof_stats[portNUM_PROCESSORS][PROF_TOTAL];
+#endif
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+#ifdef USE_PROF
+void prof_record(prof_id_t id, uint32_t cycles) {
+    int bucket = cycles == 0 ? 0 : 32 - __builtin_clz(cycles);
+    if (bucket >= PROF_HIST_BUCKETS) {
+        bucket = PROF_HIST_BUCKETS - 1;
+    }
+    UBaseType_t irq = portSET_INTERRUPT_MASK_FROM_ISR();
+    prof_stats_t *s = &prof_stats[xPortGetCoreID()][id];
+    if (s->count == 0 || cycles < s->min) {
+        s->min = cycles;
+    }
+    if (cycles > s->max) {
+        s->max = cycles;
+    }
+    s->count++;
+    s->sum += cycles;
+    s->hist[bucket]++;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(irq);
+}
+#endif
+
+bool prof_get_stats(prof_id_t id, prof_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef USE_PROF
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        // a probe ending meanwhile may be half counted, no matter
+        const prof_stats_t *s = &prof_stats[core][id];
+        if (s->count == 0) {
+            continue;
+        }
+        if (stats->count == 0 || s->min < stats->min) {
+            stats->min = s->min;
+        }
+        if (s->max > stats->max) {
+            stats->max = s->max;
+        }
+        stats->count += s->count;
+        stats->sum += s->sum;
+        for (int i = 0; i < PROF_HIST_BUCKETS; i++) {
+            stats->hist[i] += s->hist[i];
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void prof_dump(bool reset) {
+#ifdef USE_PROF
+    const uint32_t mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+    for (int id = 0; id < PROF_TOTAL; id++) {
+        prof_stats_t s;
+        prof_get_stats(id, &s);
+        if (s.count == 0) {
+            continue;
+        }
+        // non-empty buckets, as "<upper bound in cycles>:<count>", and the
+        // last one, which is open ended, as ">=<lower bound>:<count>"
+        char hist[PROF_HIST_BUCKETS * 20] = "";
+        int len = 0;
+        for (int i = 0; i < PROF_HIST_BUCKETS && len < (int)sizeof(hist); i++) {
+            if (s.hist[i] == 0) {
+                continue;
+            }
+            if (i == PROF_HIST_BUCKETS - 1) {
+                len += snprintf(hist + len, sizeof(hist) - len, " >=%" PRIu32 ":%" PRIu32,
+                                (uint32_t)1 << (i - 1), s.hist[i]);
+            } else {
+                len += snprintf(hist + len, sizeof(hist) - len, " <%" PRIu32 ":%" PRIu32,
+                                (uint32_t)1 << i, s.hist[i]);
+            }
+        }
+        ESP_LOGI(TAG, "%-10s n %" PRIu32 " cycles min %" PRIu32 " avg %" PRIu32 " max %" PRIu32
+                 " (max %" PRIu32 " us);%s",
+                 prof_names[id], s.count, s.min, (uint32_t)(s.sum / s.count), s.max, s.max / mhz,
+                 hist);
+    }
+    if (reset) {
+        // a probe ending meanwhile may be lost, or half counted, no matter
+        memset(prof_stats, 0, sizeof(prof_stats));
+    }
+#else
+    ESP_LOGI(TAG, "Compiled out, define USE_PROF in prof.h");
+#endif
+}
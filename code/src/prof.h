@@ -0,0 +1,111 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Hot path profiler
+ *
+ * Probes read the cycle counter (CCOUNT) of the core at both ends of a
+ * section of code, and keep the count, min, average, max and a histogram
+ * of the cycles taken, per probe. Without USE_PROF they are compiled out.
+ *
+ *     PROF_SCOPE(PROF_KB_SCAN);       // until the end of the block
+ *
+ *     PROF_BEGIN(lookup);
+ *     ...
+ *     PROF_END(PROF_KB_LOOKUP, lookup);
+ *
+ * The counts are per core, interrupts are masked for the few instructions
+ * that update them, so probes of tasks preempting each other do not mix.
+ * The cycles include the preemptions that happen within a probe.
+ */
+#ifndef MY_PROF_H
+#define MY_PROF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// #define USE_PROF
+
+typedef enum {
+    PROF_KB_SCAN,       // matrix scan, including the ghost key check
+    PROF_KB_LOOKUP,     // key map lookup of one key down
+    PROF_KB_REPORT,     // keyboard and consumer reports handed to the scheduler
+    PROF_TP_DECODE,     // PS2 bytes read from the UART and parsed into packets
+    PROF_TP_POINTER,    // middle button, scroll and acceleration pipeline
+    PROF_TP_REPORT,     // mouse report handed to the scheduler
+    PROF_TOTAL,
+} prof_id_t;
+
+// power of 2 buckets of cycles, the last one takes the rest
+#define PROF_HIST_BUCKETS 16
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t hist[PROF_HIST_BUCKETS];
+} prof_stats_t;
+
+#ifdef USE_PROF
+
+#include "esp_cpu.h"
+
+typedef struct {
+    prof_id_t id;
+    uint32_t start;
+} prof_scope_t;
+
+void prof_record(prof_id_t id, uint32_t cycles);
+
+static inline void prof_scope_end(prof_scope_t *scope) {
+    prof_record(scope->id, esp_cpu_get_cycle_count() - scope->start);
+}
+
+#define PROF_CAT_(a, b) a##b
+#define PROF_CAT(a, b)  PROF_CAT_(a, b)
+#define PROF_SCOPE(id)                                                                 \
+    prof_scope_t PROF_CAT(_prof_scope_, __LINE__) __attribute__((cleanup(prof_scope_end))) = \
+        {(id), esp_cpu_get_cycle_count()}
+#define PROF_BEGIN(name)   uint32_t _prof_##name = esp_cpu_get_cycle_count()
+#define PROF_END(id, name) prof_record((id), esp_cpu_get_cycle_count() - _prof_##name)
+
+#else
+
+#define PROF_SCOPE(id)
+#define PROF_BEGIN(name)
+#define PROF_END(id, name)
+
+#endif
+
+/**
+ * Sum of the cores, for one probe.
+ * @return false when compiled out
+ */
+bool prof_get_stats(prof_id_t id, prof_stats_t *stats);
+
+/**
+ * Log a line per probe, with the histogram
+ * @param reset start counting again
+ */
+void prof_dump(bool reset);
+
+#endif
@@ -0,0 +1,186 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Sampling profiler
+ *
+ * The timer interrupt runs on the interrupt stack. On the way in, the
+ * FreeRTOS port saved the registers of the task interrupted into a frame on
+ * its stack, and the address of the frame into the first word of its TCB,
+ * pxTopOfStack: the PC and a0, the return address, are read from there. An
+ * interrupt that interrupted another one is counted, without a PC, as the
+ * frame saved then is not known.
+ */
+
+#include "sampler.h"
+
+#ifdef USE_SAMPLER
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "driver/gptimer.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_ipc.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "xtensa_context.h"
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+// Samples kept between two dumps, of both cores, twice: 64 KiB
+#define SAMPLER_RING 2048
+#define SAMPLER_TIMER_HZ 1000000
+
+typedef struct {
+    TaskHandle_t task;  // NULL in an interrupt
+    uint32_t pc;
+    uint32_t caller;
+    uint32_t core;
+} sample_t;
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+static const char *TAG = "sampler";
+
+// set by the port, 1 in the first interrupt on a task
+extern volatile unsigned port_interruptNesting[portNUM_PROCESSORS];
+
+// the timers fill one buffer while the other one is printed
+static sample_t samples[2][SAMPLER_RING];
+static int sample_buf = 0;
+static uint32_t sample_head = 0;
+static uint32_t sample_lost = 0;
+static portMUX_TYPE sample_lock = portMUX_INITIALIZER_UNLOCKED;
+static gptimer_handle_t sample_timers[portNUM_PROCESSORS];
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+static bool IRAM_ATTR sample_alarm_cb(gptimer_handle_t timer,
+                                      const gptimer_alarm_event_data_t *edata, void *user_ctx) {
+    uint32_t core = xPortGetCoreID();
+    sample_t s = {.core = core};
+    if (port_interruptNesting[core] <= 1) {
+        s.task = xTaskGetCurrentTaskHandle();
+        // pxTopOfStack is the first member of the TCB
+        const XtExcFrame *frame = *(XtExcFrame *const *)s.task;
+        s.pc = frame->pc;
+        s.caller = esp_cpu_process_stack_pc(frame->a0);
+    }
+
+    portENTER_CRITICAL_ISR(&sample_lock);
+    if (sample_head < SAMPLER_RING) {
+        samples[sample_buf][sample_head++] = s;
+    } else {
+        sample_lost++;
+    }
+    portEXIT_CRITICAL_ISR(&sample_lock);
+    return false;
+}
+
+/**
+ * The interrupt of a timer is allocated on the core that registers its
+ * callbacks, this runs on each core in turn
+ */
+static void register_on_core(void *arg) {
+    static const gptimer_event_callbacks_t cbs = {.on_alarm = sample_alarm_cb};
+    *(esp_err_t *)arg = gptimer_register_event_callbacks(sample_timers[xPortGetCoreID()], &cbs,
+                                                         NULL);
+}
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+esp_err_t sampler_start(uint32_t hz) {
+    const gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = SAMPLER_TIMER_HZ,
+    };
+    const gptimer_alarm_config_t alarm_config = {
+        .alarm_count = SAMPLER_TIMER_HZ / hz,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        esp_err_t ret = gptimer_new_timer(&timer_config, &sample_timers[core]);
+        if (ret == ESP_OK) {
+            esp_err_t cb_ret = ESP_FAIL;
+            ret = esp_ipc_call_blocking(core, register_on_core, &cb_ret);
+            if (ret == ESP_OK) {
+                ret = cb_ret;
+            }
+        }
+        if (ret == ESP_OK) {
+            ret = gptimer_set_alarm_action(sample_timers[core], &alarm_config);
+        }
+        if (ret == ESP_OK) {
+            ret = gptimer_enable(sample_timers[core]);
+        }
+        if (ret == ESP_OK) {
+            ret = gptimer_start(sample_timers[core]);
+        }
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "no sampling timer on core %d: %s", core, esp_err_to_name(ret));
+            return ret;
+        }
+    }
+    ESP_LOGI(TAG, "Sampling at %" PRIu32 " Hz", hz);
+    return ESP_OK;
+}
+
+void sampler_dump(void) {
+    portENTER_CRITICAL(&sample_lock);
+    const sample_t *buf = samples[sample_buf];
+    uint32_t n = sample_head;
+    uint32_t lost = sample_lost;
+    sample_buf = !sample_buf;
+    sample_head = 0;
+    sample_lost = 0;
+    portEXIT_CRITICAL(&sample_lock);
+
+    for (uint32_t i = 0; i < n; i++) {
+        const sample_t *s = &buf[i];
+        printf("PCS,%" PRIu32 ",%s,%08" PRIx32 ",%08" PRIx32 "\n", s->core,
+               s->task != NULL ? pcTaskGetName(s->task) : "[isr]", s->pc, s->caller);
+    }
+    printf("PCS,end,%" PRIu32 ",%" PRIu32 "\n", n, lost);
+    fflush(stdout);
+}
+
+#endif
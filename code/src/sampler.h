@@ -0,0 +1,60 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Sampling profiler
+ *
+ * A timer interrupt on each core records the task it interrupted, with the
+ * PC and the return address of the code running, into a buffer.
+ * sampler_dump() prints them, every period of the task monitor or on the
+ * "samples" console command. Once the buffer is full, new samples are
+ * counted as lost until the next dump.
+ *
+ * tools/pc_sample.py symbolises the samples with the ELF and folds them
+ * into stacks for a flame graph.
+ */
+#ifndef MY_SAMPLER_H
+#define MY_SAMPLER_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// #define USE_SAMPLER
+
+// Samples per second and per core, away from the multiples of the tick and
+// USB frame rates, so as not to sample in step with them
+#define SAMPLER_HZ 197
+
+/**
+ * Start sampling both cores, at boot: the timers come from the heap.
+ * @param hz samples per second and per core
+ */
+esp_err_t sampler_start(uint32_t hz);
+
+/**
+ * Print the samples taken since the last dump, as lines of
+ * "PCS,<core>,<task>,<pc>,<caller>", then "PCS,end,<samples>,<lost>".
+ * Blocks on the console, for a task of low priority.
+ */
+void sampler_dump(void);
+
+#endif
@@ -0,0 +1,335 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Stats console
+ *
+ * The TinyUSB task hands the bytes received to the CDC driver, which
+ * notifies the console task. The task echoes them, and runs the line on a
+ * carriage return or a line feed. Commands print with printf(), which
+ * esp_tusb_init_console() sends to the same port, the logs included.
+ */
+
+#include "stats_console.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "keyboard.h"
+#include "log_ring.h"
+#include "prof.h"
+#include "sampler.h"
+#include "sdkconfig.h"
+#include "task_cfg.h"
+#include "task_monitor.h"
+#include "trackpoint.h"
+#include "tusb_hid.h"
+#include "tusb_tasks.h"
+
+#if CONFIG_TINYUSB_CDC_ENABLED
+#include "tinyusb.h"
+#include "tusb_cdc_acm.h"
+#include "tusb_console.h"
+#endif
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+// Longer lines are cut
+#define CONSOLE_LINE_MAX 64
+// Bytes the CDC driver keeps until the task reads them
+#define CONSOLE_RX_BUF 64
+
+typedef struct {
+    const char *name;
+    const char *help;
+    // arg is the rest of the line, "" if none
+    void (*run)(const char *arg);
+} console_cmd_t;
+
+/****************************************************************
+ *
+ *  Private function prototypes
+ *
+ ****************************************************************/
+
+static void cmd_help(const char *arg);
+static void cmd_tasks(const char *arg);
+static void cmd_heap(const char *arg);
+static void cmd_hid(const char *arg);
+static void cmd_tp(const char *arg);
+static void cmd_scan(const char *arg);
+static void cmd_log(const char *arg);
+#if CONFIG_TINYUSB_TASK_STATS
+static void cmd_usb(const char *arg);
+#endif
+static void cmd_prof(const char *arg);
+#ifdef USE_SAMPLER
+static void cmd_samples(const char *arg);
+#endif
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+static const char *TAG = "console";
+
+static const console_cmd_t commands[] = {
+    {"help", "this list", cmd_help},
+    {"tasks", "CPU share since the last print and stack high-water mark of each task", cmd_tasks},
+    {"heap", "free heap, low-water mark and largest free block", cmd_heap},
+    {"hid", "reports sent, retried, merged, refused and dropped by report ID, delay to the poll",
+     cmd_hid},
+    {"tp", "PS2 packets, intervals, errors and queues of the trackpoint", cmd_tp},
+    {"scan", "matrix scan rate and duration", cmd_scan},
+    {"log", "log lines written and dropped, ring depth", cmd_log},
+#if CONFIG_TINYUSB_TASK_STATS
+    {"usb", "TinyUSB task latency and load", cmd_usb},
+#endif
+    {"prof", "hot path cycle counts, \"prof reset\" starts over", cmd_prof},
+#ifdef USE_SAMPLER
+    {"samples", "PC samples taken since the last dump, see tools/pc_sample.py", cmd_samples},
+#endif
+};
+
+static TaskHandle_t console_task_handle = NULL;
+static StaticTask_t console_task_tcb;
+static StackType_t console_task_stack[CONSOLE_TASK_STACK];
+#if CONFIG_TINYUSB_CDC_ENABLED
+// stdout is reopened on the port, its buffer would come from the heap at the first write
+static char stdout_buf[128];
+#endif
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+static void cmd_help(const char *arg) {
+    (void)arg;
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        printf("%-8s %s\n", commands[i].name, commands[i].help);
+    }
+}
+
+static void cmd_tasks(const char *arg) {
+    (void)arg;
+    task_monitor_print();
+}
+
+static void cmd_heap(const char *arg) {
+    (void)arg;
+    printf("free %u, min free %u, largest block %u bytes\n",
+           (unsigned)heap_caps_get_free_size(MALLOC_CAP_DEFAULT),
+           (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT),
+           (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+}
+
+static void cmd_hid(const char *arg) {
+    (void)arg;
+    static const char *const names[3] = {"keyboard", "mouse", "consumer"};
+    tinyusb_hid_stats_t s;
+    tinyusb_hid_get_stats(&s);
+    printf("%-8s %10s %8s %9s %8s %8s\n", "report", "sent", "retried", "merged", "refused",
+           "dropped");
+    for (int i = 0; i < 3; i++) {
+        printf("%-8s %10" PRIu32 " %8" PRIu32 " %9" PRIu32 " %8" PRIu32 " %8" PRIu32 "\n", names[i],
+               s.sent[i], s.failed[i], s.coalesced[i], s.full[i], s.dropped[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (s.polled[i] != 0) {
+            printf("%s interface: poll delay avg %" PRIu32 " us, max %" PRIu32 " us\n",
+                   i == 0 ? "keyboard" : "pointer", (uint32_t)(s.poll_delay_us_sum[i] / s.polled[i]),
+                   s.poll_delay_us_max[i]);
+        }
+    }
+    printf("wakeups %" PRIu32 ", frames %" PRIu32 ", mount to report %" PRIu32 " us\n", s.wakeups,
+           s.frames, s.mount_to_report_us);
+}
+
+static void cmd_tp(const char *arg) {
+    (void)arg;
+    trackpoint_stats_t s;
+    trackpoint_get_stats(&s);
+    printf("packets %" PRIu32 " at %u Hz, %" PRIu32 " baud\n", s.packets, s.sample_rate, s.baud_rate);
+    if (s.intervals != 0) {
+        printf("interval min %" PRIu32 ", avg %" PRIu32 ", max %" PRIu32 " us, jitter %" PRIu32
+               " us\n",
+               s.interval_min_us, s.interval_avg_x16 / 16, s.interval_max_us, s.jitter_x16 / 16);
+    }
+    printf("errors: sync %" PRIu32 ", uart %" PRIu32 ", resets %" PRIu32 ", reinits %" PRIu32 "\n",
+           s.sync_errors, s.uart_errors, s.resets, s.reinits);
+    printf("queued: uart events %" PRIu32 ", commands %" PRIu32 "\n", s.uart_queued,
+           s.cmds_queued);
+}
+
+static void cmd_scan(const char *arg) {
+    (void)arg;
+    keyboard_stats_t s;
+    keyboard_get_stats(&s);
+    printf("scans %" PRIu32 ", longest %" PRIu32 " us\n", s.scans, s.scan_max_us);
+    if (s.intervals != 0) {
+        uint32_t avg = s.interval_us_sum / s.intervals;
+        printf("interval avg %" PRIu32 " us (%" PRIu32 " Hz), max %" PRIu32 " us\n", avg,
+               avg != 0 ? 1000000 / avg : 0, s.interval_max_us);
+    }
+}
+
+static void cmd_log(const char *arg) {
+    (void)arg;
+    log_ring_stats_t s;
+    log_ring_get_stats(&s);
+    printf("lines %" PRIu32 ", dropped %" PRIu32 ", most waiting %" PRIu32 "\n", s.lines,
+           s.dropped, s.max_used);
+}
+
+#if CONFIG_TINYUSB_TASK_STATS
+static void cmd_usb(const char *arg) {
+    (void)arg;
+    tusb_task_stats_t s;
+    if (tusb_get_task_stats(&s) != ESP_OK || s.probes == 0) {
+        printf("no samples\n");
+        return;
+    }
+    printf("latency avg %" PRIu32 " us, max %" PRIu32 " us, load %" PRIu32 "%% since start\n",
+           (uint32_t)(s.latency_us_sum / s.probes), s.latency_us_max,
+           s.elapsed_us != 0 ? (uint32_t)(s.run_time * 100ULL / s.elapsed_us) : 0);
+}
+#endif
+
+static void cmd_prof(const char *arg) {
+    prof_dump(strcmp(arg, "reset") == 0);
+}
+
+#ifdef USE_SAMPLER
+static void cmd_samples(const char *arg) {
+    (void)arg;
+    sampler_dump();
+}
+#endif
+
+static void run_line(char *line) {
+    char *name = line + strspn(line, " ");
+    char *arg = name + strcspn(name, " ");
+    if (*arg != '\0') {
+        *arg++ = '\0';
+        arg += strspn(arg, " ");
+    }
+    if (*name == '\0') {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strcmp(name, commands[i].name) == 0) {
+            commands[i].run(arg);
+            return;
+        }
+    }
+    printf("%s: unknown command, try help\n", name);
+}
+
+#if CONFIG_TINYUSB_CDC_ENABLED
+// from the TinyUSB task
+static void console_rx_cb(int itf, cdcacm_event_t *event) {
+    (void)itf;
+    (void)event;
+    xTaskNotifyGive(console_task_handle);
+}
+
+static void console_task(void *arg) {
+    (void)arg;
+    char line[CONSOLE_LINE_MAX];
+    size_t len = 0;
+    uint8_t rx[CONSOLE_RX_BUF];
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        size_t n = 0;
+        while (tinyusb_cdcacm_read(TINYUSB_CDC_ACM_0, rx, sizeof(rx), &n) == ESP_OK && n > 0) {
+            for (size_t i = 0; i < n; i++) {
+                char c = rx[i];
+                if (c == '\r' || c == '\n') {
+                    if (len == 0) {
+                        continue;
+                    }
+                    line[len] = '\0';
+                    len = 0;
+                    printf("\n");
+                    run_line(line);
+                    printf("> ");
+                } else if ((c == '\b' || c == 0x7f) && len > 0) {
+                    len--;
+                    printf("\b \b");
+                } else if (c >= ' ' && c < 0x7f && len < sizeof(line) - 1) {
+                    line[len++] = c;
+                    putchar(c);
+                }
+            }
+            fflush(stdout);
+        }
+    }
+}
+#endif
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+void stats_console_start(void) {
+#if CONFIG_TINYUSB_CDC_ENABLED
+    // the task first, the driver calls back as soon as the host writes
+    console_task_handle = xTaskCreateStaticPinnedToCore(
+        &console_task, "console", CONSOLE_TASK_STACK, NULL, CONSOLE_TASK_PRIORITY,
+        console_task_stack, &console_task_tcb, CONSOLE_TASK_CORE);
+
+    const tinyusb_config_cdcacm_t acm_cfg = {
+        .usb_dev = TINYUSB_USBDEV_0,
+        .cdc_port = TINYUSB_CDC_ACM_0,
+        .rx_unread_buf_sz = CONSOLE_RX_BUF,
+        .callback_rx = &console_rx_cb,
+        .callback_rx_wanted_char = NULL,
+        .callback_line_state_changed = NULL,
+        .callback_line_coding_changed = NULL,
+    };
+    if (tusb_cdc_acm_init(&acm_cfg) != ESP_OK ||
+        esp_tusb_init_console(TINYUSB_CDC_ACM_0) != ESP_OK) {
+        ESP_LOGE(TAG, "no CDC port, the console is off");
+        return;
+    }
+    setvbuf(stdout, stdout_buf, _IOLBF, sizeof(stdout_buf));
+#else
+    (void)run_line;
+    ESP_LOGW(TAG, "CONFIG_TINYUSB_CDC_ENABLED is off, no console");
+#endif
+}
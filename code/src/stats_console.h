@@ -0,0 +1,40 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Stats console
+ *
+ * A command line on the USB CDC serial port, which also takes over the
+ * console output. Each command prints counters the modules keep anyway, so
+ * it can stay in production builds: nothing is measured until asked, and an
+ * idle console is a task blocked on a notification. Type "help" for the
+ * commands.
+ */
+#ifndef MY_STATS_CONSOLE_H
+#define MY_STATS_CONSOLE_H
+
+/**
+ * Open the CDC port and start the console task, at boot, after the USB
+ * driver is installed. Does nothing without CONFIG_TINYUSB_CDC_ENABLED.
+ */
+void stats_console_start(void);
+
+#endif
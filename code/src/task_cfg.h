@@ -0,0 +1,78 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Task layout
+ *
+ * The input tasks have a core of their own, so that USB events, logging and
+ * the rest of the system never delay a scan or a PS2 transfer. Everything
+ * else runs on the other one, the TinyUSB task is placed by
+ * CONFIG_TINYUSB_TASK_AFFINITY and CONFIG_TINYUSB_TASK_PRIORITY.
+ *
+ * Priorities, highest first, configMAX_PRIORITIES - 1 is left to the IPC
+ * tasks of ESP-IDF:
+ *   trackpoint      the PS2 bit-banging is timing critical
+ *   keyboard
+ *   esp_timer       ESP-IDF, 22, runs the USB frame timer
+ *   TinyUSB         sends the reports the input tasks post
+ *   task monitor    stats console, and anything else that can wait
+ *   log             writes the log lines out, when nothing else runs
+ *
+ * The stacks are static. Size them from the high-water marks the task
+ * monitor prints, worst case on the hardware, with some room to spare.
+ */
+#ifndef MY_TASK_CFG_H
+#define MY_TASK_CFG_H
+
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+#define INPUT_CORE 1
+#define SYSTEM_CORE 0
+
+#define TP_TASK_CORE     INPUT_CORE
+#define TP_TASK_PRIORITY (configMAX_PRIORITIES - 2)
+#define TP_TASK_STACK    4096
+
+#define KB_TASK_CORE     INPUT_CORE
+#define KB_TASK_PRIORITY (configMAX_PRIORITIES - 3)
+#define KB_TASK_STACK    4096
+
+#define MONITOR_TASK_CORE     SYSTEM_CORE
+#define MONITOR_TASK_PRIORITY 2
+#define MONITOR_TASK_STACK    4096
+
+#define LOG_TASK_CORE     SYSTEM_CORE
+#define LOG_TASK_PRIORITY 1
+#define LOG_TASK_STACK    3072
+
+#define CONSOLE_TASK_CORE     SYSTEM_CORE
+#define CONSOLE_TASK_PRIORITY 2
+#define CONSOLE_TASK_STACK    4096
+
+#if CONFIG_TINYUSB_TASK_AFFINITY != SYSTEM_CORE
+#warning "The TinyUSB task is expected on SYSTEM_CORE, see CONFIG_TINYUSB_TASK_AFFINITY"
+#endif
+#if CONFIG_TINYUSB_TASK_PRIORITY >= KB_TASK_PRIORITY
+#warning "The TinyUSB task is expected below the input tasks, see CONFIG_TINYUSB_TASK_PRIORITY"
+#endif
+
+#endif
@@ -0,0 +1,306 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Task monitor
+ */
+
+#include "task_monitor.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/gptimer.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "prof.h"
+#include "sampler.h"
+#include "sdkconfig.h"
+#include "task_cfg.h"
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+// Print the table this often
+#define MONITOR_INTERVAL_MS 5000
+// Tasks shown, the others are left out
+#define MONITOR_MAX_TASKS 32
+
+// Measurement mode: a load task on each core, below the input tasks, and a
+// probe task on each core at the input priority
+// #define MONITOR_SYNTHETIC_LOAD
+
+// Share of the time the load tasks keep their core busy
+#define LOAD_DUTY_PERCENT 80
+#define LOAD_PERIOD_MS 10
+#define LOAD_PRIORITY 1
+
+// The probes are woken up from a timer interrupt every PROBE_PERIOD_US, like
+// the input tasks are by the GPIO and UART ones, then read the clock in a
+// loop for PROBE_SPIN_US: a gap longer than PROBE_GAP_US between two reads is
+// counted as a preemption, by an interrupt or a higher priority task. They
+// are reported per core: which task or interrupt preempted is not known.
+#define PROBE_TIMER_HZ 1000000
+#define PROBE_PERIOD_US 2000
+#define PROBE_SPIN_US 200
+#define PROBE_GAP_US 10
+#define PROBE_PRIORITY KB_TASK_PRIORITY
+#define LOAD_STACK 2048
+#define PROBE_STACK 2048
+
+typedef struct {
+    TaskHandle_t handle;
+    uint32_t run_time;
+} run_time_t;
+
+typedef struct {
+    uint32_t wakeups;
+    uint32_t wake_latency_us_max;
+    uint64_t wake_latency_us_sum;
+    uint32_t preemptions;
+    uint32_t preempted_us_max;
+} probe_stats_t;
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+static const char *TAG = "task-mon";
+
+// the run time counters at the last print, for the shares since
+static run_time_t last_run_time[MONITOR_MAX_TASKS];
+static int nr_last_run_time = 0;
+static int64_t last_print_us = 0;
+static portMUX_TYPE last_run_time_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static StaticTask_t monitor_tcb;
+static StackType_t monitor_stack[MONITOR_TASK_STACK];
+
+#ifdef MONITOR_SYNTHETIC_LOAD
+static probe_stats_t probe_stats[portNUM_PROCESSORS];
+static portMUX_TYPE probe_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t probe_tasks[portNUM_PROCESSORS];
+static gptimer_handle_t probe_timer;
+static volatile int64_t probe_alarm_us;
+static StaticTask_t load_tcbs[portNUM_PROCESSORS];
+static StackType_t load_stacks[portNUM_PROCESSORS][LOAD_STACK];
+static StaticTask_t probe_tcbs[portNUM_PROCESSORS];
+static StackType_t probe_stacks[portNUM_PROCESSORS][PROBE_STACK];
+#endif
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+static uint32_t get_last_run_time(const run_time_t *last, int nr_last, TaskHandle_t handle) {
+    for (int i = 0; i < nr_last; i++) {
+        if (last[i].handle == handle) {
+            return last[i].run_time;
+        }
+    }
+    return 0;
+}
+
+#ifdef MONITOR_SYNTHETIC_LOAD
+static void load_task(void *arg) {
+    (void)arg;
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        int64_t end = esp_timer_get_time() + LOAD_PERIOD_MS * 1000 * LOAD_DUTY_PERCENT / 100;
+        while (esp_timer_get_time() < end) {
+        }
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(LOAD_PERIOD_MS));
+    }
+}
+
+static bool IRAM_ATTR probe_alarm_cb(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata,
+                                     void *user_ctx) {
+    BaseType_t woken = pdFALSE;
+    probe_alarm_us = esp_timer_get_time();
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        if (probe_tasks[core] != NULL) {
+            vTaskNotifyGiveFromISR(probe_tasks[core], &woken);
+        }
+    }
+    return woken == pdTRUE;
+}
+
+static void probe_task(void *arg) {
+    probe_stats_t *stats = &probe_stats[(intptr_t)arg];
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        uint32_t latency = now - probe_alarm_us;
+
+        uint32_t preemptions = 0, preempted_max = 0;
+        int64_t end = now + PROBE_SPIN_US;
+        int64_t prev = now;
+        while (prev < end) {
+            int64_t t = esp_timer_get_time();
+            if (t - prev > PROBE_GAP_US) {
+                preemptions++;
+                if (t - prev > preempted_max) {
+                    preempted_max = t - prev;
+                }
+            }
+            prev = t;
+        }
+
+        taskENTER_CRITICAL(&probe_lock);
+        stats->wakeups++;
+        stats->wake_latency_us_sum += latency;
+        if (latency > stats->wake_latency_us_max) {
+            stats->wake_latency_us_max = latency;
+        }
+        stats->preemptions += preemptions;
+        if (preempted_max > stats->preempted_us_max) {
+            stats->preempted_us_max = preempted_max;
+        }
+        taskEXIT_CRITICAL(&probe_lock);
+    }
+}
+
+static void print_probe_stats(void) {
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        taskENTER_CRITICAL(&probe_lock);
+        probe_stats_t s = probe_stats[core];
+        probe_stats[core] = (probe_stats_t){0};
+        taskEXIT_CRITICAL(&probe_lock);
+        if (s.wakeups == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "core %d: wake latency avg %" PRIu32 " us, max %" PRIu32 " us; %" PRIu32
+                 " preemptions in %" PRIu32 " ms of spinning, longest %" PRIu32 " us",
+                 core, (uint32_t)(s.wake_latency_us_sum / s.wakeups), s.wake_latency_us_max,
+                 s.preemptions, s.wakeups * PROBE_SPIN_US / 1000, s.preempted_us_max);
+    }
+}
+
+static void start_synthetic_load(void) {
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        xTaskCreateStaticPinnedToCore(&load_task, "mon_load", LOAD_STACK, NULL, LOAD_PRIORITY,
+                                      load_stacks[core], &load_tcbs[core], core);
+        probe_tasks[core] = xTaskCreateStaticPinnedToCore(
+            &probe_task, "mon_probe", PROBE_STACK, (void *)(intptr_t)core, PROBE_PRIORITY,
+            probe_stacks[core], &probe_tcbs[core], core);
+    }
+
+    const gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = PROBE_TIMER_HZ,
+    };
+    const gptimer_event_callbacks_t cbs = {.on_alarm = probe_alarm_cb};
+    const gptimer_alarm_config_t alarm_config = {
+        .alarm_count = PROBE_PERIOD_US * (PROBE_TIMER_HZ / 1000000),
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    if (gptimer_new_timer(&timer_config, &probe_timer) != ESP_OK ||
+        gptimer_register_event_callbacks(probe_timer, &cbs, NULL) != ESP_OK ||
+        gptimer_set_alarm_action(probe_timer, &alarm_config) != ESP_OK ||
+        gptimer_enable(probe_timer) != ESP_OK || gptimer_start(probe_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "no probe timer, wake latency is not measured");
+    }
+}
+#endif
+
+static void task_monitor_task(void *arg) {
+    (void)arg;
+    task_monitor_print();
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(MONITOR_INTERVAL_MS));
+        task_monitor_print();
+#ifdef MONITOR_SYNTHETIC_LOAD
+        print_probe_stats();
+#endif
+#ifdef USE_PROF
+        prof_dump(true);
+#endif
+#ifdef USE_SAMPLER
+        sampler_dump();
+#endif
+    }
+}
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+void task_monitor_print(void) {
+    // on the stack, the monitor and the console may print at the same time
+    TaskStatus_t tasks[MONITOR_MAX_TASKS];
+    run_time_t last[MONITOR_MAX_TASKS];
+    UBaseType_t nr = uxTaskGetSystemState(tasks, MONITOR_MAX_TASKS, NULL);
+    int64_t now = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&last_run_time_lock);
+    int nr_last = nr_last_run_time;
+    for (int i = 0; i < nr_last; i++) {
+        last[i] = last_run_time[i];
+    }
+    // since boot on the first call, and the console may call at any time
+    int64_t elapsed_us = now - last_print_us;
+    for (UBaseType_t i = 0; i < nr; i++) {
+        last_run_time[i] = (run_time_t){tasks[i].xHandle, tasks[i].ulRunTimeCounter};
+    }
+    nr_last_run_time = nr;
+    last_print_us = now;
+    taskEXIT_CRITICAL(&last_run_time_lock);
+
+    if (elapsed_us <= 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "%-16s %4s %4s %7s %6s", "task", "core", "prio", "cpu%", "stack");
+    for (UBaseType_t i = 0; i < nr; i++) {
+        const TaskStatus_t *t = &tasks[i];
+        uint32_t run = t->ulRunTimeCounter - get_last_run_time(last, nr_last, t->xHandle);
+        int core = t->xCoreID == tskNO_AFFINITY ? -1 : (int)t->xCoreID;
+        ESP_LOGI(TAG, "%-16s %4d %4u %3" PRIu32 ".%" PRIu32 " %6" PRIu32, t->pcTaskName, core,
+                 (unsigned)t->uxCurrentPriority, (uint32_t)((uint64_t)run * 100 / elapsed_us),
+                 (uint32_t)((uint64_t)run * 1000 / elapsed_us % 10),
+                 (uint32_t)t->usStackHighWaterMark);
+    }
+}
+
+void task_monitor_start(void) {
+#ifdef MONITOR_SYNTHETIC_LOAD
+    // at boot, the probe timer comes from the heap
+    start_synthetic_load();
+#endif
+    xTaskCreateStaticPinnedToCore(&task_monitor_task, "task_mon", MONITOR_TASK_STACK, NULL,
+                                  MONITOR_TASK_PRIORITY, monitor_stack, &monitor_tcb,
+                                  MONITOR_TASK_CORE);
+}
@@ -0,0 +1,44 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Task monitor
+ *
+ * Prints the run time of every task periodically. In the measurement mode,
+ * it also loads both cores and measures the wake latency and the
+ * preemptions seen by a task at the priority of the input tasks.
+ */
+#ifndef MY_TASK_MONITOR_H
+#define MY_TASK_MONITOR_H
+
+/**
+ * Start the monitor task, at boot. Needs CONFIG_FREERTOS_USE_TRACE_FACILITY and
+ * CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+ */
+void task_monitor_start(void);
+
+/**
+ * Print the share of its core each task has had since the last print, by
+ * the monitor or not, and its stack high-water mark.
+ */
+void task_monitor_print(void);
+
+#endif
@@ -0,0 +1,123 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Tokenised logging
+ */
+
+#include "tlog.h"
+
+#ifdef USE_TLOG
+
+#include <string.h>
+
+#include "log_ring.h"
+
+/****************************************************************
+ *
+ *  Private Definition
+ *
+ ****************************************************************/
+
+// Longest string argument, in bytes
+#define TLOG_STR_MAX 24
+
+/****************************************************************
+ *
+ *  Private Varibles
+ *
+ ****************************************************************/
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/****************************************************************
+ *
+ *  Private functions
+ *
+ ****************************************************************/
+
+/**
+ * Append ',' and the value in hex, without the leading zeros. An argument
+ * that does not fit any more is left out, and shown as missing.
+ */
+static void put_hex(tlog_record_t *rec, char sep, uint64_t value) {
+    char digits[16];
+    int n = 0;
+    do {
+        digits[n++] = hex_digits[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    // room for the '\n' too
+    if (rec->len + 1 + n + 1 > TLOG_RECORD_MAX) {
+        return;
+    }
+    rec->buf[rec->len++] = sep;
+    while (n > 0) {
+        rec->buf[rec->len++] = digits[--n];
+    }
+}
+
+/****************************************************************
+ *
+ *  Public functions
+ *
+ ****************************************************************/
+
+void tlog_begin(tlog_record_t *rec, const char *fmt) {
+    rec->len = 0;
+    put_hex(rec, '@', (uintptr_t)fmt);
+    put_hex(rec, ',', esp_log_timestamp());
+}
+
+void tlog_put_u32(tlog_record_t *rec, uint32_t value) {
+    put_hex(rec, ',', value);
+}
+
+void tlog_put_u64(tlog_record_t *rec, uint64_t value) {
+    put_hex(rec, ',', value);
+}
+
+void tlog_put_f64(tlog_record_t *rec, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put_hex(rec, ',', bits);
+}
+
+void tlog_put_str(tlog_record_t *rec, const char *value) {
+    // '"' then the bytes in hex
+    int n = value == NULL ? 0 : strnlen(value, TLOG_STR_MAX);
+    if (rec->len + 2 + 2 * n + 1 > TLOG_RECORD_MAX) {
+        return;
+    }
+    rec->buf[rec->len++] = ',';
+    rec->buf[rec->len++] = '"';
+    for (int i = 0; i < n; i++) {
+        rec->buf[rec->len++] = hex_digits[(uint8_t)value[i] >> 4];
+        rec->buf[rec->len++] = hex_digits[value[i] & 0xf];
+    }
+}
+
+void tlog_end(tlog_record_t *rec) {
+    rec->buf[rec->len++] = '\n';
+    log_ring_write(rec->buf, rec->len);
+}
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Tokenised logging
+ *
+ * TLOGx() logs like ESP_LOGx(). With USE_TLOG, the format string goes to
+ * the .tlog_fmt section of the ELF, which is not loaded (see tlog.ld), and
+ * the device only writes its address and the raw arguments in hex:
+ *
+ *     @<format address>,<ms>,<argument>,...
+ *
+ * No formatting on the device, and a few bytes on the console instead of
+ * the whole line. tools/tlog_decode.py renders the lines with the ELF.
+ *
+ * Arguments are integers, doubles or strings, 8 at most. The tag is left
+ * out, the decoder shows the file and line instead.
+ */
+#ifndef MY_TLOG_H
+#define MY_TLOG_H
+
+#include <stdint.h>
+
+#include "esp_log.h"
+
+// #define USE_TLOG
+
+#ifdef USE_TLOG
+
+#define TLOG_RECORD_MAX 96
+
+typedef struct {
+    int len;
+    char buf[TLOG_RECORD_MAX];
+} tlog_record_t;
+
+void tlog_begin(tlog_record_t *rec, const char *fmt);
+void tlog_put_u32(tlog_record_t *rec, uint32_t value);
+void tlog_put_u64(tlog_record_t *rec, uint64_t value);
+void tlog_put_f64(tlog_record_t *rec, double value);
+void tlog_put_str(tlog_record_t *rec, const char *value);
+void tlog_end(tlog_record_t *rec);
+
+#define TLOG_STR_(x) #x
+#define TLOG_STR(x)  TLOG_STR_(x)
+#define TLOG_CAT_(a, b) a##b
+#define TLOG_CAT(a, b)  TLOG_CAT_(a, b)
+
+#define TLOG_PUT(rec, x)                                                                  \
+    _Generic((x), char *: tlog_put_str, const char *: tlog_put_str, float: tlog_put_f64, \
+             double: tlog_put_f64, int64_t: tlog_put_u64, uint64_t: tlog_put_u64,       \
+             default: tlog_put_u32)(rec, x);
+
+#define TLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define TLOG_NARGS(...) TLOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+
+#define TLOG_PUT_0(r)
+#define TLOG_PUT_1(r, a)      TLOG_PUT(r, a)
+#define TLOG_PUT_2(r, a, ...) TLOG_PUT(r, a) TLOG_PUT_1(r, __VA_ARGS__)
+#define TLOG_PUT_3(r, a, ...) TLOG_PUT(r, a) TLOG_PUT_2(r, __VA_ARGS__)
+#define TLOG_PUT_4(r, a, ...) TLOG_PUT(r, a) TLOG_PUT_3(r, __VA_ARGS__)
+#define TLOG_PUT_5(r, a, ...) TLOG_PUT(r, a) TLOG_PUT_4(r, __VA_ARGS__)
+#define TLOG_PUT_6(r, a, ...) TLOG_PUT(r, a) TLOG_PUT_5(r, __VA_ARGS__)
+#define TLOG_PUT_7(r, a, ...) TLOG_PUT(r, a) TLOG_PUT_6(r, __VA_ARGS__)
+#define TLOG_PUT_8(r, a, ...) TLOG_PUT(r, a) TLOG_PUT_7(r, __VA_ARGS__)
+
+// "<level>|<file>:<line>|<format>", the decoder splits it
+#define TLOG(level, letter, tag, fmt, ...)                                                  \
+    do {                                                                                    \
+        if (LOG_LOCAL_LEVEL >= (level)) {                                                   \
+            static const char _tlog_fmt[] __attribute__((section(".tlog_fmt"), used)) =     \
+                letter "|" __FILE__ ":" TLOG_STR(__LINE__) "|" fmt;                         \
+            tlog_record_t _tlog_rec;                                                        \
+            (void)(tag);                                                                    \
+            tlog_begin(&_tlog_rec, _tlog_fmt);                                              \
+            TLOG_CAT(TLOG_PUT_, TLOG_NARGS(__VA_ARGS__))(&_tlog_rec, ##__VA_ARGS__)         \
+            tlog_end(&_tlog_rec);                                                           \
+        }                                                                                   \
+    } while (0)
+
+#define TLOGE(tag, fmt, ...) TLOG(ESP_LOG_ERROR, "E", tag, fmt, ##__VA_ARGS__)
+#define TLOGW(tag, fmt, ...) TLOG(ESP_LOG_WARN, "W", tag, fmt, ##__VA_ARGS__)
+#define TLOGI(tag, fmt, ...) TLOG(ESP_LOG_INFO, "I", tag, fmt, ##__VA_ARGS__)
+#define TLOGD(tag, fmt, ...) TLOG(ESP_LOG_DEBUG, "D", tag, fmt, ##__VA_ARGS__)
+
+#else
+
+#define TLOGE(tag, fmt, ...) ESP_LOGE(tag, fmt, ##__VA_ARGS__)
+#define TLOGW(tag, fmt, ...) ESP_LOGW(tag, fmt, ##__VA_ARGS__)
+#define TLOGI(tag, fmt, ...) ESP_LOGI(tag, fmt, ##__VA_ARGS__)
+#define TLOGD(tag, fmt, ...) ESP_LOGD(tag, fmt, ##__VA_ARGS__)
+
+#endif
+
+#endif
@@ -23,11 +23,10 @@
  * USB & BLE interface.
  */
 
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/errno.h>
-#include <sys/fcntl.h>
-#include <sys/select.h>
 #include <sys/unistd.h>
 
 #include "driver/gpio.h"
@@ -37,12 +36,21 @@
 #include "esp_sleep.h"
 #include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "log_ring.h"
 #include "pin_cfg.h"
+#include "pointer/pointer.h"
+#include "pointer/ps2_packet.h"
+#include "prof.h"
 #include "sdkconfig.h"
 #include "tinyusb.h"
+#include "tlog.h"
+#include "trackpoint.h"
 #include "tusb.h"
 #include "tusb_hid.h"
+#include "usb_state.h"
 
 /****************************************************************
  *
@@ -50,9 +58,132 @@
  *
  ****************************************************************/
 
-// #define USE_FN_TRACKPOINT_PAN
-#define SCALE_TRACKPOINT_SPEED
-#define MOUSE_SCALE_MIN 1
+// Scroll with the trackpoint while Fn or a layer key is held
+#define USE_FN_TRACKPOINT_PAN
+
+// Smooth the jitter of slow motion, see pointer_filter_step()
+#define USE_TRACKPOINT_FILTER
+
+// Spread the motion of each packet over the USB frames until the next one
+#define USE_TRACKPOINT_RESAMPLE
+// ...and keep moving at the last speed when a packet is late
+// #define USE_TRACKPOINT_EXTRAPOLATION
+
+// Print the packet motion and the motion to report on every poll, for
+// tools/pointer_trace.py
+// #define TRACE_TRACKPOINT_MOTION
+
+// Stages of the pointer pipeline, from the switches above
+#ifdef USE_FN_TRACKPOINT_PAN
+#define TP_PIPELINE_FN_PAN POINTER_PIPELINE_FN_PAN
+#else
+#define TP_PIPELINE_FN_PAN 0
+#endif
+#ifdef USE_TRACKPOINT_FILTER
+#define TP_PIPELINE_FILTER POINTER_PIPELINE_FILTER
+#else
+#define TP_PIPELINE_FILTER 0
+#endif
+#ifdef USE_TRACKPOINT_RESAMPLE
+#define TP_PIPELINE_RESAMPLE POINTER_PIPELINE_RESAMPLE
+#else
+#define TP_PIPELINE_RESAMPLE 0
+#endif
+#ifdef USE_TRACKPOINT_EXTRAPOLATION
+#define TP_PIPELINE_EXTRAPOLATE POINTER_PIPELINE_EXTRAPOLATE
+#else
+#define TP_PIPELINE_EXTRAPOLATE 0
+#endif
+#define TP_PIPELINE_OPTIONS \
+    (TP_PIPELINE_FN_PAN | TP_PIPELINE_FILTER | TP_PIPELINE_RESAMPLE | TP_PIPELINE_EXTRAPOLATE)
+
+// Give up a PS2 byte transfer that takes longer than this
+#define PS2_XFER_TIMEOUT_US 25000
+
+// Spin while cond holds, and return ret once the transfer deadline has passed
+#define PS2_WAIT_WHILE(cond, ret)                        \
+    do {                                                 \
+        while (cond) {                                   \
+            if (esp_timer_get_time() > ps2_deadline) {   \
+                return ret;                              \
+            }                                            \
+        }                                                \
+    } while (0)
+
+#define PS2_ACK 0xfa
+
+// Sample rate set at initialization, in Hz: 40, 60, 80, 100 or 200
+#define TP_SAMPLE_RATE 80
+
+// The PS2 clock is generated by the trackpoint and does not depend on the
+// sample rate, it is measured while reading the init responses instead.
+#define PS2_BAUD_DEFAULT 14465
+#define PS2_BAUD_MIN     10000
+#define PS2_BAUD_MAX     16700
+
+// Intervals longer than this many sample periods start a new motion burst
+#define TP_STATS_GAP_PERIODS 4
+
+// Log the packet statistics periodically
+// #define TP_STATS_LOG_INTERVAL_US 5000000
+
+// Give up an initialization attempt that takes longer than this
+#define TP_INIT_TIMEOUT_US 1000000
+// Delay before retrying, doubled after each failed attempt
+#define TP_INIT_BACKOFF_MIN_US 100000
+#define TP_INIT_BACKOFF_MAX_US 5000000
+
+// Drop a packet that is still incomplete after this long
+#define TP_PACKET_TIMEOUT_US 10000
+// Reinitialize after this many stream errors without a good packet between
+#define TP_MAX_ERROR_STREAK 8
+
+#define PS2_BAT_OK    0xaa  // self-test passed, sent after power-on or reset
+#define PS2_MOUSE_ID  0x00  // device ID, sent after PS2_BAT_OK
+
+// Depth of the trackpoint RAM command queue
+#define TP_CMD_QUEUE_LEN 16
+
+// Depth of the UART event queue
+#define TP_UART_QUEUE_LEN 16
+
+// TrackPoint RAM settings sent after initialization, see trackpoint.h
+// #define TP_CFG_SENSITIVITY      0x80
+// #define TP_CFG_INERTIA          0x06
+// #define TP_CFG_DRIFT_TIME       0x05
+// #define TP_CFG_PRESS_TO_SELECT  false
+
+typedef enum {
+    TP_CMD_RAM_WRITE,
+    TP_CMD_RAM_READ,
+    TP_CMD_RAM_SET_BITS,
+    TP_CMD_RAM_CLEAR_BITS,
+    TP_CMD_SET_SAMPLE_RATE,
+} tp_cmd_op_t;
+
+typedef enum {
+    TP_INIT_START,    // assert the reset line
+    TP_INIT_RELEASE,  // release the reset line
+    TP_INIT_PROBE,    // find the write timing that the trackpoint accepts
+    TP_INIT_SEQ,      // send the commands of tp_init_seq
+    TP_INIT_BACKOFF,  // wait before the next attempt
+    TP_INIT_DONE,     // streaming
+} tp_init_state_t;
+
+typedef struct {
+    tp_init_state_t state;
+    int step;            // index in tp_init_seq
+    int64_t wake_us;     // time to run the next step
+    int64_t start_us;    // start of the current attempt
+    int64_t backoff_us;  // delay before the next attempt
+} tp_init_t;
+
+typedef struct {
+    tp_cmd_op_t op;
+    uint8_t addr;
+    uint8_t value;  // value to write, or mask of the bits
+    trackpoint_read_cb_t cb;
+} tp_cmd_t;
 
 /****************************************************************
  *
@@ -60,8 +191,67 @@
  *
  ****************************************************************/
 
-// UART1 fd for select()
-static int uart1_fd = -1;
+// UART1 event queue, NULL until the trackpoint streams for the first time
+static QueueHandle_t uart1_queue = NULL;
+// Given by trackpoint_frame_sync() to wake the task up for a USB frame. The
+// UART queue belongs to the driver and its ISR, nothing else posts to it.
+static SemaphoreHandle_t tp_frame_sem = NULL;
+static StaticSemaphore_t tp_frame_sem_buf;
+// what the task waits on: the UART events and the frames
+static QueueSetHandle_t tp_wait_set = NULL;
+
+// motion packet being assembled
+static ps2_packet_t tp_packet;
+static int64_t tp_packet_start_us;
+// stream errors since the last good packet
+static int tp_error_streak = 0;
+// time the trackpoint was lost, 0 if it was not
+static int64_t tp_lost_us = 0;
+
+// buttons from the trackpoint, and as last reported
+static uint8_t tp_buttons = 0;
+static uint8_t tp_report_buttons = 0;
+
+// deadline of the PS2 byte being transferred
+static int64_t ps2_deadline;
+
+// PS2 write timing that the trackpoint accepts
+static bool (*ps2_write_fn)(uint8_t) = NULL;
+
+// PS2 clock measured by ps2_read()
+static int64_t ps2_clk_us_sum = 0;
+static uint32_t ps2_clk_periods = 0;
+
+// measured packet rate, shared with trackpoint_get_stats()
+static trackpoint_stats_t tp_stats = {.sample_rate = TP_SAMPLE_RATE};
+static int64_t tp_last_packet_us = 0;
+static portMUX_TYPE tp_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// trackpoint bring-up, run step by step by the trackpoint task
+static tp_init_t tp_init = {.state = TP_INIT_START, .backoff_us = TP_INIT_BACKOFF_MIN_US};
+
+// Commands sent at initialization, each after a delay in ms
+static const struct {
+    uint8_t cmd;
+    uint8_t delay_ms;
+} tp_init_seq[] = {
+    {0xff, 70},            // mouse reset
+    {0xff, 70},            // mouse reset
+    {0xf3, 70},            // set sample rate
+    {TP_SAMPLE_RATE, 3},   // in Hz
+    {0xf4, 3},             // enable data reporting
+};
+
+// RAM commands waiting for the trackpoint task
+static QueueHandle_t tp_cmd_queue = NULL;
+static StaticQueue_t tp_cmd_queue_buf;
+static uint8_t tp_cmd_queue_storage[TP_CMD_QUEUE_LEN * sizeof(tp_cmd_t)];
+
+// middle button, scroll and pointer motion not reported yet
+static pointer_pipeline_t tp_pipeline;
+// the resampler needs the next frame, read by trackpoint_frame_sync() from
+// the frame timer
+static atomic_bool mouse_resample_busy = false;
 
 static const char *TAG = "tp-task";
 
@@ -71,7 +261,6 @@ static const char *TAG = "tp-task";
  *
  ****************************************************************/
 
-extern bool is_usb_connected;
 
 /****************************************************************
  *
@@ -80,12 +269,27 @@ extern bool is_usb_connected;
  ****************************************************************/
 
 static void ps2_gpio_init(void);
-static uint8_t ps2_read(void);
-static void ps2_write_1(uint8_t ch);
-static void ps2_write_2(uint8_t ch);
+static int ps2_read(void);
+static bool ps2_write_1(uint8_t ch);
+static bool ps2_write_2(uint8_t ch);
+static bool ps2_write(uint8_t ch);
+static bool ps2_command(const uint8_t *cmd, int nr_cmd, uint8_t *resp, int nr_resp);
+
+static bool is_valid_sample_rate(uint8_t rate);
+static void reset_packet_stats(uint8_t rate);
+static void count_tp_stat(uint32_t *counter);
+static void update_packet_stats(int64_t now);
 
-static void init_trackpoint(void);
+static void start_trackpoint_uart(void);
+static void reset_uart_events(void);
+static void install_trackpoint_uart(void);
+static void lose_trackpoint(const char *reason);
+static TickType_t step_trackpoint_init(void);
 
+static void run_trackpoint_commands(void);
+
+static bool feed_trackpoint_byte(uint8_t b, int64_t now);
+static int64_t packet_period_us(void);
 static void poll_trackpoint(uint poll_ms);
 
 /****************************************************************
@@ -106,51 +310,55 @@ static void ps2_gpio_init(void) {
 
 /**
  * Read one byte from PS2.
- * **Only for trackpoint initialization!**
- * @return result
+ * **Only for trackpoint initialization and commands!**
+ * @return result, or -1 on timeout
  */
-static uint8_t ps2_read(void) {
-    while (PS2_CLK_STATE == 1)
-        ;
-    while (PS2_CLK_STATE == 0)
-        ;
+static int ps2_read(void) {
+    ps2_deadline = esp_timer_get_time() + PS2_XFER_TIMEOUT_US;
+
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, -1);
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 0, -1);
 
     uint8_t res = 0;
+    int64_t t_bit0 = 0;
     for (int i = 0; i < 8; i++) {
-        while (PS2_CLK_STATE == 1)
-            ;
+        PS2_WAIT_WHILE(PS2_CLK_STATE == 1, -1);
+        // time the 7 clock periods between the first and the last data bit
+        if (i == 0) {
+            t_bit0 = esp_timer_get_time();
+        } else if (i == 7) {
+            ps2_clk_us_sum += esp_timer_get_time() - t_bit0;
+            ps2_clk_periods += 7;
+        }
         if (PS2_DATA_STATE != 0) {
             res |= (1 << i);
         }
-        while (PS2_CLK_STATE == 0)
-            ;
-    }
-    while (PS2_CLK_STATE == 1)
-        ;
-    while (PS2_CLK_STATE == 0)
-        ;
-    while (PS2_CLK_STATE == 1)
-        ;
-    while (PS2_CLK_STATE == 0)
-        ;
-
-    printf("receive 0x%02x\n", res);
+        PS2_WAIT_WHILE(PS2_CLK_STATE == 0, -1);
+    }
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, -1);
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 0, -1);
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, -1);
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 0, -1);
+
+    TLOGD(TAG, "receive 0x%02x", res);
     return res;
 }
 
 /**
  * Write one byte to PS2.
- * **Only for trackpoint initialization!**
+ * **Only for trackpoint initialization and commands!**
  * @param ch command
+ * @return false on timeout
  */
-static void ps2_write_1(uint8_t ch) {
+static bool ps2_write_1(uint8_t ch) {
     uint8_t op = ch ^ 0x1;
     op = op ^ (op >> 4);
     op = op ^ (op >> 2);
     op = op ^ (op >> 1);
     op &= 0x1;
 
-    printf("0x%02x, parity %c\n", ch, op ? '1' : '0');
+    TLOGD(TAG, "0x%02x, parity %c", ch, op ? '1' : '0');
+    ps2_deadline = esp_timer_get_time() + PS2_XFER_TIMEOUT_US;
 
     PS2_CLK_OUTPUT;
     PS2_DATA_OUTPUT;
@@ -165,61 +373,55 @@ static void ps2_write_1(uint8_t ch) {
     PS2_CLK_INPUT;
 
     // data
-    while (PS2_CLK_STATE == 1)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
     // printf("0x%02x,1 parity %c\n", ch, op ? '1' : '0');
     for (int i = 0; i < 8; i++) {
-        while (PS2_CLK_STATE == 0)
-            ;
+        PS2_WAIT_WHILE(PS2_CLK_STATE == 0, false);
         if (ch & 0x1) {
             PS2_DATA_HIGH;
         } else {
             PS2_DATA_LOW;
         }
         ch >>= 1;
-        while (PS2_CLK_STATE == 1)
-            ;
+        PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
     }
 
     // odd parity
-    while (PS2_CLK_STATE == 0)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 0, false);
     if (op) {
         PS2_DATA_HIGH;
     } else {
         PS2_DATA_LOW;
     }
-    while (PS2_CLK_STATE == 1)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
 
     // end
-    while (PS2_CLK_STATE == 0)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 0, false);
     PS2_DATA_HIGH;
     PS2_DATA_INPUT;
-    while (PS2_CLK_STATE == 1)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
 
     // ack
-    while (PS2_CLK_STATE == 0)
-        ;
-    while (PS2_CLK_STATE == 1)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 0, false);
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
+    return true;
 }
 
 /**
  * Write one byte to PS2, using yet another timing...
- * **Only for trackpoint initialization!**
+ * **Only for trackpoint initialization and commands!**
  * @param ch command
+ * @return false on timeout
  */
-static void ps2_write_2(uint8_t ch) {
+static bool ps2_write_2(uint8_t ch) {
     uint8_t op = ch ^ 0x1;
     op = op ^ (op >> 4);
     op = op ^ (op >> 2);
     op = op ^ (op >> 1);
     op &= 0x1;
 
-    printf("0x%02x, parity %c\n", ch, op ? '1' : '0');
+    TLOGD(TAG, "0x%02x, parity %c", ch, op ? '1' : '0');
+    ps2_deadline = esp_timer_get_time() + PS2_XFER_TIMEOUT_US;
 
     PS2_CLK_OUTPUT;
     PS2_DATA_OUTPUT;
@@ -234,8 +436,7 @@ static void ps2_write_2(uint8_t ch) {
     PS2_CLK_INPUT;
 
     // data
-    while (PS2_CLK_STATE == 1)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
     for (int i = 0; i < 8; i++) {
         usleep(20);
         if (ch & 0x1) {
@@ -244,10 +445,8 @@ static void ps2_write_2(uint8_t ch) {
             PS2_DATA_LOW;
         }
         ch >>= 1;
-        while (PS2_CLK_STATE == 0)
-            ;
-        while (PS2_CLK_STATE == 1)
-            ;
+        PS2_WAIT_WHILE(PS2_CLK_STATE == 0, false);
+        PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
     }
 
     // odd parity
@@ -257,216 +456,637 @@ static void ps2_write_2(uint8_t ch) {
     } else {
         PS2_DATA_LOW;
     }
-    while (PS2_CLK_STATE == 0)
-        ;
-    while (PS2_CLK_STATE == 1)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 0, false);
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
 
     // end
     usleep(20);
     // PS2_DATA_HIGH;
     PS2_DATA_INPUT;
-    while (PS2_DATA_STATE == 1)
-        ;
-    while (PS2_CLK_STATE == 1)
-        ;
+    PS2_WAIT_WHILE(PS2_DATA_STATE == 1, false);
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
 
     // ack
-    while (PS2_CLK_STATE == 0)
-        ;
-    while (PS2_CLK_STATE == 1)
-        ;
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 0, false);
+    PS2_WAIT_WHILE(PS2_CLK_STATE == 1, false);
+    return true;
 }
 
-static void init_trackpoint(void) {
-    ps2_gpio_init();
-
-    // reset mouse
-    gpio_reset_pin(PS2_RESET_PIN);
-    gpio_set_direction(PS2_RESET_PIN, GPIO_MODE_OUTPUT);
-    gpio_set_level(PS2_RESET_PIN, 1);
-    vTaskDelay(10 / portTICK_PERIOD_MS);
-    gpio_set_level(PS2_RESET_PIN, 0);
-    vTaskDelay(70 / portTICK_PERIOD_MS);
-
-    uint8_t ret = 0;
-    void (*ps2_write)(uint8_t) = ps2_write_1;
-
-    ps2_write(0xff);  // mouse reset
-    ret = ps2_read();
-    if (ret != 0xfa) {
-        ESP_LOGI(TAG, "Use another timing...");
-        ps2_write = ps2_write_2;
-    }
-    int nrtry = 0;
-    for (nrtry = 0; nrtry < 5; nrtry++) {
-        ESP_LOGI(TAG, "Init round %d", nrtry);
-        vTaskDelay(70 / portTICK_PERIOD_MS);
-        ps2_write(0xff);  // mouse reset
-        if (ps2_read() != 0xfa) continue;
-        vTaskDelay(70 / portTICK_PERIOD_MS);
-        ps2_write(0xff);  // mouse reset
-        if (ps2_read() != 0xfa) continue;
-        vTaskDelay(70 / portTICK_PERIOD_MS);
-        ps2_write(0xf3);  // set sample rate
-        if (ps2_read() != 0xfa) continue;
-        vTaskDelay(3 / portTICK_PERIOD_MS);
-        ps2_write(0x50);  // set sample rate 80
-        if (ps2_read() != 0xfa) continue;
-        vTaskDelay(3 / portTICK_PERIOD_MS);
-        // ps2_write(0xf2);  // mouse id
-        // if (ps2_read() != 0xfa) continue;
-        // vTaskDelay(50 / portTICK_PERIOD_MS);
-        ps2_write(0xf4);  // enable data reporting
-        if (ps2_read() != 0xfa)
-            continue;
-        else
-            break;
+/**
+ * Write one byte to PS2 with the timing chosen at initialization,
+ * and release the bus if the trackpoint stops clocking.
+ * @param ch command
+ * @return false on timeout
+ */
+static bool ps2_write(uint8_t ch) {
+    if (ps2_write_fn(ch)) {
+        return true;
     }
+    PS2_DATA_HIGH;
+    PS2_DATA_INPUT;
+    PS2_CLK_INPUT;
+    return false;
+}
 
-    if (nrtry < 5) {
-        ESP_LOGI(TAG, "PS2 initialized.");
-
-        /**
-         * From now on, PS2 will only be used as a receiver, and the DATA line
-         * has the identical timing to a UART...
-         */
-        const uart_config_t uart_config = {
-            .baud_rate = 14465,
-            .data_bits = UART_DATA_8_BITS,
-            .parity = UART_PARITY_ODD,
-            .stop_bits = UART_STOP_BITS_1,
-            .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-            .source_clk = UART_SCLK_APB,
-        };
-        uart_driver_install(UART_NUM_1, 1024 * 2, 0, 0, NULL, 0);
-        uart_param_config(UART_NUM_1, &uart_config);
-        uart_set_pin(UART_NUM_1, -1, PS2_DATA_PIN, -1, -1);
-
-        uart1_fd = open("/dev/uart/1", O_RDWR);
-        if (uart1_fd < 0) {
-            printf("Failed to open uart1. Mouse task exit...\n");
+/**
+ * Send a command sequence, each byte being acknowledged, then read the response.
+ * @param cmd command bytes
+ * @param nr_cmd number of command bytes
+ * @param resp response buffer
+ * @param nr_resp number of response bytes
+ * @return false on any missing ack or timeout
+ */
+static bool ps2_command(const uint8_t *cmd, int nr_cmd, uint8_t *resp, int nr_resp) {
+    for (int i = 0; i < nr_cmd; i++) {
+        if (!ps2_write(cmd[i]) || ps2_read() != PS2_ACK) {
+            return false;
+        }
+    }
+    for (int i = 0; i < nr_resp; i++) {
+        int ret = ps2_read();
+        if (ret < 0) {
+            return false;
+        }
+        resp[i] = ret;
+    }
+    return true;
+}
+
+/**
+ * Run one queued RAM command.
+ * @param cmd command
+ * @return false if the trackpoint did not respond
+ */
+static bool exec_trackpoint_command(const tp_cmd_t *cmd) {
+    uint8_t val;
+    switch (cmd->op) {
+        case TP_CMD_RAM_WRITE:
+            return ps2_command((uint8_t[]){0xe2, 0x81, cmd->addr, cmd->value}, 4, NULL, 0);
+
+        case TP_CMD_RAM_READ: {
+            bool ok = ps2_command((uint8_t[]){0xe2, 0x80, cmd->addr}, 3, &val, 1);
+            if (cmd->cb != NULL) {
+                cmd->cb(cmd->addr, ok ? val : -1);
+            }
+            return ok;
+        }
+
+        case TP_CMD_RAM_SET_BITS:
+        case TP_CMD_RAM_CLEAR_BITS: {
+            // bits can only be toggled, so find out which ones need to
+            if (!ps2_command((uint8_t[]){0xe2, 0x80, cmd->addr}, 3, &val, 1)) {
+                return false;
+            }
+            uint8_t want = cmd->op == TP_CMD_RAM_SET_BITS ? cmd->value : 0;
+            uint8_t toggle = (val ^ want) & cmd->value;
+            if (toggle == 0) {
+                return true;
+            }
+            return ps2_command((uint8_t[]){0xe2, 0x47, cmd->addr, toggle}, 4, NULL, 0);
+        }
+
+        case TP_CMD_SET_SAMPLE_RATE:
+            if (!ps2_command((uint8_t[]){0xf3, cmd->value}, 2, NULL, 0)) {
+                return false;
+            }
+            reset_packet_stats(cmd->value);
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Run the queued RAM commands between two motion packets.
+ *
+ * Data reporting is paused meanwhile, so that no motion packet gets in the
+ * way of the responses, which are read by bit-banging while the UART also
+ * sees them on the DATA line. Whatever the UART got is thrown away after.
+ */
+static void run_trackpoint_commands(void) {
+    tp_cmd_t cmd;
+    size_t buffered = 0;
+
+    if (uart1_queue == NULL || tp_init.state != TP_INIT_DONE || tp_cmd_queue == NULL ||
+        uxQueueMessagesWaiting(tp_cmd_queue) == 0) {
+        return;
+    }
+    // not in the middle of a packet
+    uart_get_buffered_data_len(UART_NUM_1, &buffered);
+    if (buffered != 0 || tp_packet.len != 0) {
+        return;
+    }
+
+    // disable data reporting, a packet may still be on the way before the ack
+    bool ok = ps2_write(0xf5);
+    for (int i = 0; ok && i < 4; i++) {
+        int ret = ps2_read();
+        if (ret == PS2_ACK) break;
+        if (ret < 0 || i == 3) ok = false;
+    }
+
+    while (ok && xQueueReceive(tp_cmd_queue, &cmd, 0) == pdTRUE) {
+        ok = exec_trackpoint_command(&cmd);
+        if (!ok) {
+            TLOGW(TAG, "RAM command %d at 0x%02x failed", cmd.op, cmd.addr);
+        }
+    }
+
+    // enable data reporting
+    if (!ps2_command((uint8_t[]){0xf4}, 1, NULL, 0)) {
+        TLOGW(TAG, "Failed to re-enable data reporting");
+    }
+    uart_flush_input(UART_NUM_1);
+    reset_uart_events();
+}
+
+static esp_err_t queue_trackpoint_command(const tp_cmd_t *cmd) {
+    if (tp_cmd_queue == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return xQueueSend(tp_cmd_queue, cmd, 0) == pdTRUE ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+static bool is_valid_sample_rate(uint8_t rate) {
+    return rate == 40 || rate == 60 || rate == 80 || rate == 100 || rate == 200;
+}
+
+/**
+ * Count an event in tp_stats, which trackpoint_get_stats() reads from other
+ * tasks. The trackpoint task is the only writer, it reads them without the lock.
+ * @param counter field of tp_stats
+ */
+static void count_tp_stat(uint32_t *counter) {
+    taskENTER_CRITICAL(&tp_stats_lock);
+    (*counter)++;
+    taskEXIT_CRITICAL(&tp_stats_lock);
+}
+
+/**
+ * Start the packet statistics over, e.g. after changing the sample rate.
+ * @param rate sample rate in Hz
+ */
+static void reset_packet_stats(uint8_t rate) {
+    taskENTER_CRITICAL(&tp_stats_lock);
+    tp_stats.sample_rate = rate;
+    tp_stats.packets = 0;
+    tp_stats.intervals = 0;
+    tp_stats.interval_min_us = tp_stats.interval_max_us = 0;
+    tp_stats.interval_avg_x16 = tp_stats.jitter_x16 = 0;
+    taskEXIT_CRITICAL(&tp_stats_lock);
+    tp_last_packet_us = 0;
+}
+
+/**
+ * Account a motion packet.
+ *
+ * The packets are timestamped when the task reads them, so this is the rate
+ * and jitter as delivered to the HID report, not as sent on the wire. The
+ * trackpoint only streams while the stick is being pushed, and the interval
+ * across a pause is not a sample period, so only intervals within a burst
+ * are counted.
+ * @param now time the packet was read
+ */
+static void update_packet_stats(int64_t now) {
+    int64_t interval = now - tp_last_packet_us;
+    tp_last_packet_us = now;
+
+    taskENTER_CRITICAL(&tp_stats_lock);
+    trackpoint_stats_t *st = &tp_stats;
+    st->packets++;
+    if (interval > 0 && interval < 1000000 * TP_STATS_GAP_PERIODS / st->sample_rate) {
+        uint32_t iv = interval;
+        if (st->intervals == 0) {
+            st->interval_min_us = st->interval_max_us = iv;
+            st->interval_avg_x16 = iv << 4;
+            st->jitter_x16 = 0;
         } else {
-            printf("VFS open uart1\n");
+            if (iv < st->interval_min_us) st->interval_min_us = iv;
+            if (iv > st->interval_max_us) st->interval_max_us = iv;
+            // running averages with a weight of 1/16
+            int32_t dev = (int32_t)(iv << 4) - (int32_t)st->interval_avg_x16;
+            st->interval_avg_x16 += dev / 16;
+            st->jitter_x16 += ((dev < 0 ? -dev : dev) - (int32_t)st->jitter_x16) / 16;
+        }
+        st->intervals++;
+    }
+    taskEXIT_CRITICAL(&tp_stats_lock);
+
+#ifdef TP_STATS_LOG_INTERVAL_US
+    static int64_t last_log = 0;
+    if (now - last_log > TP_STATS_LOG_INTERVAL_US) {
+        trackpoint_stats_t s;
+        trackpoint_get_stats(&s);
+        TLOGI(TAG, "%u Hz: %" PRIu32 " packets, interval %" PRIu32 " us (%" PRIu32 "..%" PRIu32
+              "), jitter %" PRIu32 " us",
+              s.sample_rate, s.packets, s.interval_avg_x16 >> 4, s.interval_min_us,
+              s.interval_max_us, s.jitter_x16 >> 4);
+        last_log = now;
+    }
+#endif
+}
+
+/**
+ * Throw away the pending UART events, and the frame wakeup. They are taken
+ * through the queue set, which has to stay in step with its members, so no
+ * xQueueReset() here.
+ */
+static void reset_uart_events(void) {
+    QueueSetMemberHandle_t member;
+    while ((member = xQueueSelectFromSet(tp_wait_set, 0)) != NULL) {
+        if (member == uart1_queue) {
+            uart_event_t event;
+            xQueueReceive(uart1_queue, &event, 0);
+        } else {
+            xSemaphoreTake(tp_frame_sem, 0);
         }
-    } else {
-        ESP_LOGI(TAG, "Failed to init trackpoint...");
     }
 }
 
+/**
+ * Switch the DATA line over to the UART, now that the trackpoint streams.
+ * The driver is installed by trackpoint_init(), here the pin is taken and the
+ * baud rate updated.
+ */
+static void start_trackpoint_uart(void) {
+    int baud_rate = PS2_BAUD_DEFAULT;
+    if (ps2_clk_periods > 0) {
+        baud_rate = 1000000LL * ps2_clk_periods / ps2_clk_us_sum;
+        TLOGI(TAG, "PS2 clock measured at %d Hz", baud_rate);
+        if (baud_rate < PS2_BAUD_MIN || baud_rate > PS2_BAUD_MAX) {
+            baud_rate = PS2_BAUD_DEFAULT;
+        }
+    }
+    reset_packet_stats(TP_SAMPLE_RATE);
+
+    tp_packet.len = 0;
+    tp_error_streak = 0;
+    uint32_t reconnect_us = 0;
+    if (tp_lost_us != 0) {
+        reconnect_us = esp_timer_get_time() - tp_lost_us;
+        TLOGI(TAG, "Trackpoint back after %" PRIu32 " ms", reconnect_us / 1000);
+        tp_lost_us = 0;
+    }
+    taskENTER_CRITICAL(&tp_stats_lock);
+    tp_stats.baud_rate = baud_rate;
+    if (reconnect_us != 0) {
+        tp_stats.reconnect_us = reconnect_us;
+    }
+    taskEXIT_CRITICAL(&tp_stats_lock);
+
+    // the pin was a GPIO for the initialization
+    uart_set_pin(UART_NUM_1, -1, PS2_DATA_PIN, -1, -1);
+    uart_set_baudrate(UART_NUM_1, baud_rate);
+    uart_flush_input(UART_NUM_1);
+    reset_uart_events();
+}
+
+/**
+ * Install the UART driver, at boot: its buffer and event queue come from the
+ * heap, and nothing else is allocated afterwards.
+ */
+static void install_trackpoint_uart(void) {
+    /**
+     * PS2 will only be used as a receiver, and the DATA line has the
+     * identical timing to a UART...
+     */
+    const uart_config_t uart_config = {
+        .baud_rate = PS2_BAUD_DEFAULT,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_ODD,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_APB,
+    };
+    // the event queue reports the framing and parity errors too
+    uart_driver_install(UART_NUM_1, 1024 * 2, 0, TP_UART_QUEUE_LEN, &uart1_queue, 0);
+    // both still empty, as a queue set needs them to be
+    tp_frame_sem = xSemaphoreCreateBinaryStatic(&tp_frame_sem_buf);
+    tp_wait_set = xQueueCreateSet(TP_UART_QUEUE_LEN + 1);
+    xQueueAddToSet(uart1_queue, tp_wait_set);
+    xQueueAddToSet(tp_frame_sem, tp_wait_set);
+    uart_param_config(UART_NUM_1, &uart_config);
+    // the initialization takes the pin as a GPIO again, as after a reset
+    uart_set_pin(UART_NUM_1, -1, PS2_DATA_PIN, -1, -1);
+    // Hand over each packet as soon as it is complete. With the default
+    // timeout of 10 symbols a packet waits ~7ms, longer than a 200Hz period.
+    uart_set_rx_full_threshold(UART_NUM_1, 3);
+    uart_set_rx_timeout(UART_NUM_1, 1);
+}
+
+/**
+ * Give up the stream and run the initialization again, after a reset of
+ * the trackpoint or when the stream cannot be made sense of any more.
+ * @param reason for the log
+ */
+static void lose_trackpoint(const char *reason) {
+    TLOGW(TAG, "Trackpoint lost: %s, reinitializing", reason);
+    count_tp_stat(&tp_stats.reinits);
+    tp_lost_us = esp_timer_get_time();
+    tp_init.state = TP_INIT_START;
+    tp_init.wake_us = 0;
+    tp_init.backoff_us = TP_INIT_BACKOFF_MIN_US;
+
+    tp_packet.len = 0;
+    tp_buttons = 0;
+    pointer_pipeline_reset(&tp_pipeline, TP_PIPELINE_OPTIONS);
+    mouse_resample_busy = false;
+    // do not leave a button held down on the host
+    if (tp_report_buttons != 0 && usb_state_is(USB_STATE_MOUNTED)) {
+        tinyusb_hid_mouse_report(0, 0, 0, 0, 0);
+    }
+    tp_report_buttons = 0;
+}
+
+/**
+ * Run one step of the trackpoint bring-up.
+ *
+ * Each step is at most one PS2 transfer, which is bounded by
+ * PS2_XFER_TIMEOUT_US, and the delays between them are left to the caller,
+ * so the task never sleeps or spins for long here. A failed attempt is
+ * retried from the reset line, after a delay that doubles each time.
+ * @return ticks to wait before the next step
+ */
+static TickType_t step_trackpoint_init(void) {
+    _Static_assert(TP_SAMPLE_RATE == 40 || TP_SAMPLE_RATE == 60 || TP_SAMPLE_RATE == 80 ||
+                       TP_SAMPLE_RATE == 100 || TP_SAMPLE_RATE == 200,
+                   "Unsupported trackpoint sample rate");
+
+    int64_t now = esp_timer_get_time();
+    bool ok = true;
+
+    if (now < tp_init.wake_us) {
+        return pdMS_TO_TICKS((tp_init.wake_us - now + 999) / 1000);
+    }
+
+    switch (tp_init.state) {
+        case TP_INIT_START:
+            count_tp_stat(&tp_stats.init_attempts);
+            tp_init.start_us = now;
+            ps2_gpio_init();
+            ps2_clk_us_sum = 0;
+            ps2_clk_periods = 0;
+            // reset mouse
+            gpio_reset_pin(PS2_RESET_PIN);
+            gpio_set_direction(PS2_RESET_PIN, GPIO_MODE_OUTPUT);
+            gpio_set_level(PS2_RESET_PIN, 1);
+            tp_init.state = TP_INIT_RELEASE;
+            tp_init.wake_us = now + 10000;
+            break;
+
+        case TP_INIT_RELEASE:
+            gpio_set_level(PS2_RESET_PIN, 0);
+            tp_init.state = TP_INIT_PROBE;
+            tp_init.wake_us = now + 70000;
+            break;
+
+        case TP_INIT_PROBE:
+            ps2_write_fn = ps2_write_1;
+            ps2_write(0xff);  // mouse reset
+            if (ps2_read() != PS2_ACK) {
+                TLOGI(TAG, "Use another timing...");
+                ps2_write_fn = ps2_write_2;
+            }
+            tp_init.state = TP_INIT_SEQ;
+            tp_init.step = 0;
+            tp_init.wake_us = now + tp_init_seq[0].delay_ms * 1000;
+            break;
+
+        case TP_INIT_SEQ:
+            ok = ps2_command(&tp_init_seq[tp_init.step].cmd, 1, NULL, 0);
+            if (ok && ++tp_init.step == sizeof(tp_init_seq) / sizeof(tp_init_seq[0])) {
+                start_trackpoint_uart();
+                uint32_t init_us = esp_timer_get_time() - tp_init.start_us;
+                taskENTER_CRITICAL(&tp_stats_lock);
+                tp_stats.init_us = init_us;
+                taskEXIT_CRITICAL(&tp_stats_lock);
+                TLOGI(TAG, "PS2 initialized in %" PRIu32 " us, attempt %" PRIu32, init_us,
+                      tp_stats.init_attempts);
+                tp_init.state = TP_INIT_DONE;
+                tp_init.backoff_us = TP_INIT_BACKOFF_MIN_US;
+#ifdef TP_CFG_SENSITIVITY
+                trackpoint_set_sensitivity(TP_CFG_SENSITIVITY);
+#endif
+#ifdef TP_CFG_INERTIA
+                trackpoint_set_inertia(TP_CFG_INERTIA);
+#endif
+#ifdef TP_CFG_DRIFT_TIME
+                trackpoint_set_drift_time(TP_CFG_DRIFT_TIME);
+#endif
+#ifdef TP_CFG_PRESS_TO_SELECT
+                trackpoint_set_press_to_select(TP_CFG_PRESS_TO_SELECT);
+#endif
+                return 0;
+            }
+            if (ok) {
+                tp_init.wake_us = now + tp_init_seq[tp_init.step].delay_ms * 1000;
+            }
+            break;
+
+        case TP_INIT_BACKOFF:
+            tp_init.state = TP_INIT_START;
+            return 0;
+
+        case TP_INIT_DONE:
+            return 0;
+    }
+
+    if (!ok || esp_timer_get_time() - tp_init.start_us > TP_INIT_TIMEOUT_US) {
+        TLOGI(TAG, "Failed to init trackpoint, retry in %" PRId64 " ms",
+              tp_init.backoff_us / 1000);
+        tp_init.state = TP_INIT_BACKOFF;
+        tp_init.wake_us = esp_timer_get_time() + tp_init.backoff_us;
+        tp_init.backoff_us *= 2;
+        if (tp_init.backoff_us > TP_INIT_BACKOFF_MAX_US) {
+            tp_init.backoff_us = TP_INIT_BACKOFF_MAX_US;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add one byte to the motion packet being assembled, see ps2_packet_feed().
+ * @param b byte received
+ * @param now time it was read
+ * @return true once a packet is complete in tp_packet
+ */
+static bool feed_trackpoint_byte(uint8_t b, int64_t now) {
+    bool is_start = tp_packet.len == 0;
+    switch (ps2_packet_feed(&tp_packet, b)) {
+        case PS2_PACKET_OUT_OF_SYNC:
+            count_tp_stat(&tp_stats.sync_errors);
+            tp_error_streak++;
+            return false;
+        case PS2_PACKET_MORE:
+            if (is_start) {
+                tp_packet_start_us = now;
+            }
+            return false;
+        default:
+            tp_error_streak = 0;
+            return true;
+    }
+}
+
+/**
+ * Expected interval between two motion packets
+ */
+static int64_t packet_period_us(void) {
+    // the measured one, once there is enough of a motion burst
+    if (tp_stats.intervals >= 16) {
+        return tp_stats.interval_avg_x16 >> 4;
+    }
+    return 1000000 / tp_stats.sample_rate;
+}
+
 /**
  * Check the trackpoint PS2 input within a short time
  * @param poll_us poll time in microsecond
  */
 static void poll_trackpoint(uint poll_us) {
-    if (uart1_fd < 0) {
+    if (uart1_queue == NULL) {
         vTaskDelay(poll_us / 1000 / portTICK_PERIOD_MS);
         return;
     }
 
-    // expire time for select()
-    struct timeval mouse_tv = {
-        .tv_sec = 0,
-        .tv_usec = poll_us,
-    };
-
-    static bool is_midkey = false, is_pan = true;
-
-    int8_t buttons = 0, dx = 0, dy = 0;
-    int8_t pan_x = 0, pan_y = 0;
+    int16_t dx = 0, dy = 0;
     bool is_recv = false;
 
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(uart1_fd, &rfds);
-
     // wait for PS2 input...
-    int s = select(uart1_fd + 1, &rfds, NULL, NULL, &mouse_tv);
-
-    if (s < 0) {
-        ESP_LOGE(TAG, "Select failed: errno %d. Exit...", errno);
-        close(uart1_fd);
-        uart1_fd = -1;
-    } else if (s != 0) {
-        // parse all the PS2 packets
-        while (1) {
-            char mousebuf[3];
-            int nrrd = uart_read_bytes(UART_NUM_1, mousebuf, 3, 5);
-            if (nrrd > 0) {
-                if (nrrd < 3) {
-                    // read the remaining bytes
-                    int nrrd2 = uart_read_bytes(UART_NUM_1, &mousebuf[nrrd], 3 - nrrd, 3);
-                    nrrd += nrrd2;
-                }
-                if (nrrd == 3) {
-                    // printf("recv: %02x %02x %02x\n", mousebuf[0], mousebuf[1], mousebuf[2]);
-                    buttons |= mousebuf[0];
-                    dx += mousebuf[1], dy -= mousebuf[2];
-                    is_recv = true;
-                } else {
-                    // printf("Only receive %d chars: ", nrrd);
-                    // for (int nr = 0; nr < nrrd; nr++) {
-                    //   printf("%02x ", mousebuf[nr]);
-                    // }
-                    // printf("\n");
-
-                    // discard the dirty data
-                    buttons = dx = dy = 0;
-                    is_recv = false;
-                    uart_flush_input(UART_NUM_1);
-                    break;
-                }
-            } else {
+    uart_event_t event;
+    // come back on the next USB frame while there is motion to spread
+#if CONFIG_TINYUSB_HID_SOF_SYNC
+    // trackpoint_frame_sync() wakes us up just before the host polls, this is
+    // only in case frames stop
+    const unsigned frame_wait_us = 2 * TINYUSB_HID_POLL_INTERVAL_US;
+#else
+    const unsigned frame_wait_us = TINYUSB_HID_POLL_INTERVAL_US;
+#endif
+    if (mouse_resample_busy && poll_us > frame_wait_us) {
+        poll_us = frame_wait_us;
+    }
+    TickType_t wait = pdMS_TO_TICKS(poll_us / 1000);
+    QueueSetMemberHandle_t member;
+    while ((member = xQueueSelectFromSet(tp_wait_set, wait)) != NULL) {
+        wait = 0;
+        if (member == tp_frame_sem) {
+            // a USB frame, time to spread the motion further
+            xSemaphoreTake(tp_frame_sem, 0);
+            continue;
+        }
+        if (xQueueReceive(uart1_queue, &event, 0) != pdTRUE) {
+            continue;
+        }
+        switch (event.type) {
+            case UART_FRAME_ERR:
+            case UART_PARITY_ERR:
+                count_tp_stat(&tp_stats.uart_errors);
+                tp_error_streak++;
+                break;
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                // discard the dirty data
+                count_tp_stat(&tp_stats.uart_errors);
+                tp_error_streak++;
+                tp_packet.len = 0;
+                uart_flush_input(UART_NUM_1);
+                reset_uart_events();
+                break;
+            default:
                 break;
-            }
         }
     }
 
-    buttons &= 0b00000111;
-    if (is_recv) {
-        // mid key detection
-        if (buttons & 0b00000100) {
-            is_midkey = true;
-            // printf("midkey press\n");
-            if (dx != 0 || dy != 0) {
-                // middle key for pan
-                pan_x = dx > 0 ? 1 : dx < 0 ? -1 : 0;
-                pan_y = dy < 0 ? 1 : dy > 0 ? -1 : 0;
-                dx = dy = 0;
-                is_pan = true;
-                // printf("midkey pan\n");
+    // parse all the PS2 packets
+    uint8_t buf[32];
+    int nrrd;
+    int64_t now = esp_timer_get_time();
+    PROF_BEGIN(decode);
+    while ((nrrd = uart_read_bytes(UART_NUM_1, buf, sizeof(buf), 0)) > 0) {
+        for (int i = 0; i < nrrd; i++) {
+            if (!feed_trackpoint_byte(buf[i], now)) {
+                continue;
             }
-        } else {
-            if (is_midkey && !is_pan) {
-                // printf("send mid key\n");
-                if (is_usb_connected) {
-                    tinyusb_hid_mouse_report(0b00000100, 0, 0, 0, 0);
-                    vTaskDelay(20);
-                    tinyusb_hid_mouse_report(0, 0, 0, 0, 0);
-                    vTaskDelay(20);
-                }
-            }
-            is_midkey = is_pan = false;
-
-#ifdef SCALE_TRACKPOINT_SPEED
-            // Scale the trackpoint mouse since it may be too slow...
-            if (dx > MOUSE_SCALE_MIN)
-                dx += (dx - MOUSE_SCALE_MIN) * 2;
-            else if (dx < -MOUSE_SCALE_MIN)
-                dx += (dx + MOUSE_SCALE_MIN) * 2;
-            if (dy > MOUSE_SCALE_MIN)
-                dy += (dy - MOUSE_SCALE_MIN) * 2;
-            else if (dy < -MOUSE_SCALE_MIN)
-                dy += (dy + MOUSE_SCALE_MIN) * 2;
-#endif
+            // printf("recv: %02x %02x %02x\n", tp_packet.data[0], tp_packet.data[1],
+            //        tp_packet.data[2]);
+            int16_t px, py;
+            ps2_packet_motion(&tp_packet, &px, &py);
+            tp_buttons = tp_packet.data[0] & PS2_PACKET_BUTTONS;
+            dx += px;
+            dy -= py;
+            is_recv = true;
+            update_packet_stats(now);
         }
+    }
+    PROF_END(PROF_TP_DECODE, decode);
 
-        if (is_usb_connected) {
-            tinyusb_hid_mouse_report(buttons & 0b00000011, dx, dy, pan_y, pan_x);
+    // The bytes of a packet come back to back, a packet left incomplete is
+    // either a loss of sync, or the self-test result sent after a reset,
+    // which the trackpoint follows by nothing as data reporting is off.
+    if (tp_packet.len > 0 && now - tp_packet_start_us > TP_PACKET_TIMEOUT_US) {
+        if (tp_packet.len == 2 && tp_packet.data[0] == PS2_BAT_OK &&
+            tp_packet.data[1] == PS2_MOUSE_ID) {
+            count_tp_stat(&tp_stats.resets);
+            lose_trackpoint("self-test after reset");
+            return;
         }
+        count_tp_stat(&tp_stats.sync_errors);
+        tp_error_streak++;
+        tp_packet.len = 0;
+    }
+    if (tp_error_streak >= TP_MAX_ERROR_STREAK) {
+        lose_trackpoint("too many stream errors");
+        return;
+    }
 
-        // printf("Mouse %3d, %3d; Pan %3d, %3d; Buttons 0x%02x\n", dx, dy, pan_x, pan_y, buttons);
+    PROF_BEGIN(pointer);
+    const pointer_frame_in_t in = {
+        .dx = dx,
+        .dy = dy,
+        .is_recv = is_recv,
+        .middle = tp_buttons & 0b00000100,
+        .kb_flags = atomic_load_explicit(&pointer_kb_flags, memory_order_relaxed),
+        .period_us = packet_period_us(),
+        .now_us = now,
+        .multiplier = tinyusb_hid_resolution_multiplier(),
+        .xy_limit = TINYUSB_HID_MOUSE_XY_MAX,
+    };
+    pointer_frame_out_t out;
+    mouse_resample_busy = pointer_pipeline_step(&tp_pipeline, &in, &out);
+#ifdef TRACE_TRACKPOINT_MOTION
+    if (out.packet_x != 0 || out.packet_y != 0 || out.frame_x != 0 || out.frame_y != 0) {
+        log_ring_printf("TPM,%" PRId64 ",%" PRId32 ",%" PRId32 ",%" PRId32 ",%" PRId32 "\n", now,
+                        out.packet_x, out.packet_y, out.frame_x, out.frame_y);
+    }
+#endif
+    PROF_END(PROF_TP_POINTER, pointer);
+
+    // skip the packets that are still below one unit after scaling
+    uint8_t report_buttons = tp_buttons & 0b00000011;
+    if (out.midkey & POINTER_MIDKEY_BUTTON_DOWN) {
+        report_buttons |= 0b00000100;
     }
+    // while suspended, only a click wakes the host up, not drift
+    bool is_motion = out.x != 0 || out.y != 0 || out.wheel != 0 || out.pan != 0;
+    EventBits_t state = xEventGroupGetBits(usb_state);
+    bool is_awake = state & USB_STATE_ACTIVE;
+    bool can_wake = (state & USB_STATE_WAKEUP_ALLOWED) && report_buttons != tp_report_buttons;
+    if ((is_motion || report_buttons != tp_report_buttons) && (is_awake || can_wake)) {
+        PROF_BEGIN(report);
+        tinyusb_hid_mouse_report(report_buttons, out.x, out.y, out.wheel, out.pan);
+        PROF_END(PROF_TP_REPORT, report);
+        tp_report_buttons = report_buttons;
+        if (tp_stats.first_report_us == 0) {
+            int64_t first_report_us = esp_timer_get_time();
+            taskENTER_CRITICAL(&tp_stats_lock);
+            tp_stats.first_report_us = first_report_us;
+            taskEXIT_CRITICAL(&tp_stats_lock);
+            TLOGI(TAG, "First pointer report at %" PRId64 " ms after boot",
+                  first_report_us / 1000);
+        }
+    }
+
+    // printf("Mouse %3d, %3d; Pan %3d, %3d; Buttons 0x%02x\n", out.x, out.y, out.pan, out.wheel,
+    //        report_buttons);
 }
 
 /****************************************************************
@@ -476,23 +1096,72 @@ static void poll_trackpoint(uint poll_us) {
  ****************************************************************/
 
 unsigned get_kb_scan_interval_us(void) { return 5000 * 5 / 6; }
-/**
- * trackpoint task
- */
+
+esp_err_t trackpoint_ram_write(uint8_t addr, uint8_t value) {
+    tp_cmd_t cmd = {.op = TP_CMD_RAM_WRITE, .addr = addr, .value = value};
+    return queue_trackpoint_command(&cmd);
+}
+
+esp_err_t trackpoint_ram_read(uint8_t addr, trackpoint_read_cb_t cb) {
+    tp_cmd_t cmd = {.op = TP_CMD_RAM_READ, .addr = addr, .cb = cb};
+    return queue_trackpoint_command(&cmd);
+}
+
+esp_err_t trackpoint_ram_set_bits(uint8_t addr, uint8_t mask, bool set) {
+    tp_cmd_t cmd = {
+        .op = set ? TP_CMD_RAM_SET_BITS : TP_CMD_RAM_CLEAR_BITS,
+        .addr = addr,
+        .value = mask,
+    };
+    return queue_trackpoint_command(&cmd);
+}
+
+esp_err_t trackpoint_set_sample_rate(uint8_t rate) {
+    if (!is_valid_sample_rate(rate)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    tp_cmd_t cmd = {.op = TP_CMD_SET_SAMPLE_RATE, .value = rate};
+    return queue_trackpoint_command(&cmd);
+}
+
+void trackpoint_frame_sync(void) {
+    if (tp_frame_sem != NULL && mouse_resample_busy) {
+        xSemaphoreGive(tp_frame_sem);
+    }
+}
+
+void trackpoint_get_stats(trackpoint_stats_t *stats) {
+    taskENTER_CRITICAL(&tp_stats_lock);
+    *stats = tp_stats;
+    taskEXIT_CRITICAL(&tp_stats_lock);
+    stats->uart_queued = uart1_queue != NULL ? uxQueueMessagesWaiting(uart1_queue) : 0;
+    stats->cmds_queued = tp_cmd_queue != NULL ? uxQueueMessagesWaiting(tp_cmd_queue) : 0;
+}
+
+void trackpoint_init(void) {
+    tp_cmd_queue = xQueueCreateStatic(TP_CMD_QUEUE_LEN, sizeof(tp_cmd_t), tp_cmd_queue_storage,
+                                      &tp_cmd_queue_buf);
+    pointer_profiles_init();
+    pointer_pipeline_reset(&tp_pipeline, TP_PIPELINE_OPTIONS);
+    install_trackpoint_uart();
+}
+
 void trackpoint_task(void *arg) {
     (void)arg;
 
-    ESP_LOGI(TAG, "START");
-    init_trackpoint();
-    ESP_LOGI(TAG, "Init finish");
+    TLOGI(TAG, "START");
 
     while (1) {
-        // Poll here and do not bother using semaphores...
-        if (!is_usb_connected) {
-            vTaskDelay(2000);
+        if (tp_init.state != TP_INIT_DONE) {
+            TickType_t wait = step_trackpoint_init();
+            if (wait > 0) {
+                vTaskDelay(wait);
+            }
             continue;
         }
 
+        // Keep draining the stream while USB is away, reports are dropped.
         poll_trackpoint(get_kb_scan_interval_us());
+        run_trackpoint_commands();
     }
 }
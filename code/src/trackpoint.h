@@ -0,0 +1,171 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Trackpoint interface
+ *
+ * The RAM commands are queued and run by the trackpoint task between two
+ * motion packets, so they can be called from any task at any time.
+ */
+
+#ifndef MY_TRACKPOINT_H
+#define MY_TRACKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/**
+ * TrackPoint RAM locations, from the IBM TrackPoint engineering spec.
+ * Power-on defaults in brackets.
+ */
+#define TP_RAM_SENS        0x4A  // Sensitivity [0x80]
+#define TP_RAM_INERTIA     0x4D  // Negative inertia factor [0x06]
+#define TP_RAM_REACH       0x57  // Backup for Z-axis press [0xFF]
+#define TP_RAM_DRAGHYS     0x58  // Drag hysteresis [0xFF]
+#define TP_RAM_MINDRAG     0x59  // Minimum force to trigger dragging [0x14]
+#define TP_RAM_UP_THRESH   0x5A  // Z-axis release threshold for a click [0xFF]
+#define TP_RAM_THRESH      0x5C  // Minimum value for a Z-axis press [0x08]
+#define TP_RAM_JENKS_CURV  0x5D  // Minimum curvature for double click [0x87]
+#define TP_RAM_Z_TIME      0x5E  // How sharp of a press [0x26]
+#define TP_RAM_DRIFT_TIME  0x5F  // Hands off time before drift correction, x 107ms [0x05]
+#define TP_RAM_SPEED       0x60  // Speed of the cursor [0x61]
+
+/**
+ * TrackPoint flag bits, as RAM location and mask
+ */
+#define TP_FLAG_DRIFT_LOC  0x23  // Drift correction disabled
+#define TP_FLAG_DRIFT_MASK 0x80
+#define TP_FLAG_PTSON_LOC  0x2C  // Press to select
+#define TP_FLAG_PTSON_MASK 0x01
+
+/**
+ * Trackpoint statistics, packet intervals are only counted within a motion burst
+ */
+typedef struct {
+    uint16_t sample_rate;       // requested sample rate in Hz
+    uint32_t baud_rate;         // UART baud rate, from the measured PS2 clock
+    uint32_t packets;           // motion packets received
+    uint32_t intervals;         // packet intervals counted
+    uint32_t interval_min_us;
+    uint32_t interval_max_us;
+    uint32_t interval_avg_x16;  // running average interval, in 1/16 us
+    uint32_t jitter_x16;        // running average deviation from it, in 1/16 us
+    uint32_t init_attempts;     // initialization attempts since boot
+    uint32_t init_us;           // duration of the last successful initialization
+    int64_t first_report_us;    // first pointer report, since boot, 0 until then
+    uint32_t resets;            // self-test results seen in the stream
+    uint32_t sync_errors;       // bytes or partial packets dropped to resync
+    uint32_t uart_errors;       // framing, parity and overflow errors
+    uint32_t reinits;           // initializations after losing the stream
+    uint32_t reconnect_us;      // from losing the stream to streaming again, last time
+    uint32_t uart_queued;       // UART events waiting, when the stats were read
+    uint32_t cmds_queued;       // commands waiting
+} trackpoint_stats_t;
+
+/**
+ * Called from the trackpoint task with the result of trackpoint_ram_read().
+ * @param addr RAM location
+ * @param value byte read, or -1 on failure
+ */
+typedef void (*trackpoint_read_cb_t)(uint8_t addr, int value);
+
+/**
+ * Queue a write to the TrackPoint RAM.
+ * @param addr RAM location
+ * @param value byte to write
+ * @return ESP_ERR_NO_MEM if the command queue is full
+ */
+esp_err_t trackpoint_ram_write(uint8_t addr, uint8_t value);
+
+/**
+ * Queue a read from the TrackPoint RAM.
+ * @param addr RAM location
+ * @param cb result callback
+ * @return ESP_ERR_NO_MEM if the command queue is full
+ */
+esp_err_t trackpoint_ram_read(uint8_t addr, trackpoint_read_cb_t cb);
+
+/**
+ * Queue setting or clearing flag bits in the TrackPoint RAM.
+ * The TrackPoint can only toggle bits, so they are read back first.
+ * @param addr RAM location
+ * @param mask bits to change
+ * @param set true to set the bits, false to clear them
+ * @return ESP_ERR_NO_MEM if the command queue is full
+ */
+esp_err_t trackpoint_ram_set_bits(uint8_t addr, uint8_t mask, bool set);
+
+/**
+ * Queue a change of the sample rate. The packet statistics start over.
+ * @param rate sample rate in Hz: 40, 60, 80, 100 or 200
+ * @return ESP_ERR_INVALID_ARG on an unsupported rate
+ */
+esp_err_t trackpoint_set_sample_rate(uint8_t rate);
+
+/**
+ * Have the trackpoint task hand over the motion due, if any, for the next USB
+ * frame. Called ahead of the frame when the input is timed to the SOF.
+ */
+void trackpoint_frame_sync(void);
+
+/**
+ * Get a snapshot of the motion packet statistics.
+ * @param stats output
+ */
+void trackpoint_get_stats(trackpoint_stats_t *stats);
+
+static inline esp_err_t trackpoint_set_sensitivity(uint8_t sens) {
+    return trackpoint_ram_write(TP_RAM_SENS, sens);
+}
+
+static inline esp_err_t trackpoint_set_inertia(uint8_t inertia) {
+    return trackpoint_ram_write(TP_RAM_INERTIA, inertia);
+}
+
+static inline esp_err_t trackpoint_set_drift_time(uint8_t drift_time) {
+    return trackpoint_ram_write(TP_RAM_DRIFT_TIME, drift_time);
+}
+
+static inline esp_err_t trackpoint_set_press_threshold(uint8_t thresh, uint8_t up_thresh) {
+    esp_err_t ret = trackpoint_ram_write(TP_RAM_THRESH, thresh);
+    return ret != ESP_OK ? ret : trackpoint_ram_write(TP_RAM_UP_THRESH, up_thresh);
+}
+
+static inline esp_err_t trackpoint_set_drift_correction(bool enable) {
+    return trackpoint_ram_set_bits(TP_FLAG_DRIFT_LOC, TP_FLAG_DRIFT_MASK, !enable);
+}
+
+static inline esp_err_t trackpoint_set_press_to_select(bool enable) {
+    return trackpoint_ram_set_bits(TP_FLAG_PTSON_LOC, TP_FLAG_PTSON_MASK, enable);
+}
+
+/**
+ * Allocate what the trackpoint task needs, at boot before it starts
+ */
+void trackpoint_init(void);
+
+/**
+ * trackpoint task
+ */
+void trackpoint_task(void *arg);
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * This file is part of esp32s3-keyboard.
+ *
+ * Copyright (C) 2020-2021 Yuquan He <heyuquan20b at ict dot ac dot cn>
+ * (Institute of Computing Technology, Chinese Academy of Sciences)
+ *
+ * esp32s3-keyboard is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esp32s3-keyboard is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esp32s3-keyboard. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * USB connection state
+ *
+ * Set by the TinyUSB callbacks in main.c, the input tasks block on the bits
+ * they need instead of polling, so they are running again as soon as the
+ * host has mounted or resumed the device.
+ */
+#ifndef MY_USB_STATE_H
+#define MY_USB_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#define USB_STATE_MOUNTED        BIT0  // configured by the host
+#define USB_STATE_SUSPENDED      BIT1  // bus suspended, still mounted
+#define USB_STATE_WAKEUP_ALLOWED BIT2  // remote wakeup enabled for this suspend
+#define USB_STATE_ACTIVE         BIT3  // mounted and not suspended
+
+extern EventGroupHandle_t usb_state;
+
+// esp_timer time of the last mount or resume
+extern volatile int64_t usb_active_us;
+
+static inline bool usb_state_is(EventBits_t bits) {
+    return (xEventGroupGetBits(usb_state) & bits) == bits;
+}
+
+/**
+ * Block until all the bits are set.
+ * @param bits USB_STATE_*
+ */
+static inline void usb_state_wait(EventBits_t bits) {
+    xEventGroupWaitBits(usb_state, bits, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+#endif
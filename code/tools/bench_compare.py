@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""
+Compare two runs of the microbenchmarks, see src/bench/bench.h.
+
+Capture the BENCH lines of a run before and after a change, from the board
+or from the host, then:
+
+    pio run -e bench_native -t exec | tee before.log
+    python3 tools/bench_compare.py before.log after.log
+
+The minimum of each case is compared, it is the least disturbed by the
+interrupts and the caches. The exit status is 1 when a case got slower by
+more than --threshold percent, for a script to catch.
+"""
+
+import argparse
+import sys
+
+
+def parse(path):
+    """{(target, case): (iterations, min, median, max, unit)} of a capture"""
+    results = {}
+    with open(path, errors="replace") as f:
+        for line in f:
+            idx = line.find("BENCH,")
+            if idx < 0:
+                continue
+            fields = line[idx:].strip().split(",")
+            if len(fields) != 8:
+                continue
+            try:
+                results[(fields[1], fields[2])] = (int(fields[3]), float(fields[4]),
+                                                   float(fields[5]), float(fields[6]), fields[7])
+            except ValueError:
+                continue
+    if not results:
+        sys.exit("%s: no BENCH lines found" % path)
+    return results
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("before", help="capture of the reference run")
+    ap.add_argument("after", help="capture of the run to check")
+    ap.add_argument("--threshold", type=float, default=5.0,
+                    help="slowdown in percent counted as a regression")
+    args = ap.parse_args()
+
+    before, after = parse(args.before), parse(args.after)
+    regressions = 0
+    print("%-8s %-18s %-6s %12s %12s %8s" % ("target", "case", "unit", "before", "after", "change"))
+    for key in sorted(set(before) | set(after)):
+        if key not in before or key not in after:
+            print("%-8s %-18s %s" % (key[0], key[1], "only before" if key in before else "new"))
+            continue
+        b, a = before[key], after[key]
+        change = (a[1] - b[1]) * 100.0 / b[1] if b[1] else 0.0
+        flag = ""
+        if change > args.threshold:
+            regressions += 1
+            flag = "  slower"
+        print("%-8s %-18s %-6s %12.2f %12.2f %+7.1f%%%s" % (key[0], key[1], a[4], b[1], a[1],
+                                                           change, flag))
+    sys.exit(1 if regressions else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Turn the samples of the sampling profiler into a flame graph, see src/sampler.h.
+
+Build with USE_SAMPLER defined in src/sampler.h and USE_TASK_MONITOR in
+src/main.c, capture the console for a while, then:
+
+    pio device monitor | tee capture.log
+    python3 tools/pc_sample.py .pio/build/esp32-s3-devkitc-1/firmware.elf capture.log > out.folded
+    flamegraph.pl out.folded > out.svg
+
+Each "PCS,<core>,<task>,<pc>,<caller>" line is one sample. The PC and the
+return address are symbolised with addr2line against the ELF, and counted
+as the folded stack "<task>;<caller>;<function>", the format of
+flamegraph.pl and speedscope. Only the caller is known, the stacks are two
+functions deep.
+
+--top prints the functions taking the most samples instead.
+"""
+
+import argparse
+import collections
+import subprocess
+import sys
+
+ADDR2LINE = "xtensa-esp32s3-elf-addr2line"
+
+
+def parse(lines):
+    """Samples as (core, task, pc, caller), and the samples lost"""
+    samples, lost = [], 0
+    for line in lines:
+        idx = line.find("PCS,")
+        if idx < 0:
+            continue
+        fields = line[idx + 4:].strip().split(",")
+        try:
+            if fields[0] == "end":
+                lost += int(fields[2])
+                continue
+            samples.append((int(fields[0]), fields[1], int(fields[2], 16), int(fields[3], 16)))
+        except (IndexError, ValueError):
+            continue
+    return samples, lost
+
+
+def symbolise(addr2line, elf, addrs):
+    """Function name of each address, with one run of addr2line"""
+    addrs = sorted(a for a in addrs if a != 0)
+    names = {0: "[unknown]"}
+    if not addrs:
+        return names
+    out = subprocess.run([addr2line, "-f", "-C", "-e", elf], input="\n".join(
+        "%x" % a for a in addrs) + "\n", capture_output=True, text=True, check=True).stdout
+    lines = out.splitlines()
+    for i, a in enumerate(addrs):
+        name = lines[2 * i] if 2 * i < len(lines) else "??"
+        names[a] = "0x%08x" % a if name == "??" else name
+    return names
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("elf", help="firmware ELF of the build running")
+    ap.add_argument("log", nargs="?", help="captured console, stdin if omitted")
+    ap.add_argument("--addr2line", default=ADDR2LINE, help="addr2line of the toolchain")
+    ap.add_argument("--core", type=int, help="only the samples of this core")
+    ap.add_argument("--by-core", action="store_true", help="root the stacks at the core")
+    ap.add_argument("--top", type=int, metavar="N", help="print the N busiest functions")
+    args = ap.parse_args()
+
+    with (open(args.log, errors="replace") if args.log else sys.stdin) as f:
+        samples, lost = parse(f)
+    if args.core is not None:
+        samples = [s for s in samples if s[0] == args.core]
+    if not samples:
+        sys.exit("no PCS lines found, is USE_SAMPLER defined?")
+    if lost:
+        print("%d samples lost, dump more often or sample slower" % lost, file=sys.stderr)
+
+    names = symbolise(args.addr2line, args.elf, {s[2] for s in samples} | {s[3] for s in samples})
+
+    if args.top:
+        flat = collections.Counter((s[1] if s[1] == "[isr]" else names[s[2]]) for s in samples)
+        print("%8s %7s  %s" % ("samples", "%", "function"))
+        for name, n in flat.most_common(args.top):
+            print("%8d %6.1f%%  %s" % (n, 100.0 * n / len(samples), name))
+        return
+
+    folded = collections.Counter()
+    for core, task, pc, caller in samples:
+        stack = [task] if task == "[isr]" else [task, names[caller], names[pc]]
+        if args.by_core:
+            stack.insert(0, "core%d" % core)
+        folded[";".join(stack)] += 1
+    for stack, n in sorted(folded.items()):
+        print("%s %d" % (stack, n))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+"""
+Measure what the trackpoint motion stages cost and gain, from a trace.
+
+Build with TRACE_TRACKPOINT_MOTION defined in src/trackpoint.c, capture the
+serial output while using the trackpoint, then:
+
+    pio device monitor | tee capture.log
+    python3 tools/pointer_trace.py capture.log
+    python3 tools/pointer_trace.py --replay capture.log
+
+Each "TPM,<us>,<in x>,<in y>,<out x>,<out y>" line is one poll, motion in
+1/256 count after pointer_scale(): the motion of the packet received, if any,
+and the motion handed to the report after the resampler and the filter.
+
+The trace is cut into windows, and for each window the script finds the
+delay that best lines the output position up with the packet one. Windows
+are grouped by stick speed, so the latency added to fast moves and the
+smoothing of slow aiming can be read separately.
+
+Smoothness is the coefficient of variation of the motion per USB frame
+while the stick moves: 0 for a cursor moving at an even pace, above 3 for
+a 80 Hz stream reported on 1 ms frames as it comes.
+
+--replay runs the packets of the trace through src/pointer/pointer.c again,
+built for the host, with and without resampling, on simulated USB frames.
+"""
+
+import argparse
+import bisect
+import ctypes
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+WINDOW_US = 100000
+MAX_LAG_US = 50000
+LAG_STEP_US = 500
+SPEED_BINS = (100, 300, 1000, 3000)  # count/s
+
+POINTER_C = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "pointer",
+                         "pointer.c")
+
+
+def parse(lines):
+    """Times, packet motion and output motion of each poll"""
+    t, inp, out = [], [], []
+    for line in lines:
+        idx = line.find("TPM,")
+        if idx < 0:
+            continue
+        try:
+            us, ix, iy, ox, oy = (int(v) for v in line[idx + 4:].strip().split(",")[:5])
+        except ValueError:
+            continue
+        t.append(us)
+        inp.append((ix, iy))
+        out.append((ox, oy))
+    return t, inp, out
+
+
+def integrate(motion):
+    pos, x, y = [], 0, 0
+    for dx, dy in motion:
+        x += dx
+        y += dy
+        pos.append((x, y))
+    return pos
+
+
+def interp(t, pos, at):
+    """Position at time 'at', linear between samples"""
+    i = bisect.bisect_right(t, at)
+    if i == 0:
+        return pos[0]
+    if i == len(t):
+        return pos[-1]
+    f = (at - t[i - 1]) / (t[i] - t[i - 1])
+    return tuple(a + (b - a) * f for a, b in zip(pos[i - 1], pos[i]))
+
+
+def best_lag(ref_t, ref, t, pos, lo, hi):
+    best = (None, 0)
+    for lag in range(0, MAX_LAG_US + 1, LAG_STEP_US):
+        err = 0.0
+        for i in range(lo, hi):
+            r = interp(ref_t, ref, t[i] - lag)
+            err += (pos[i][0] - r[0]) ** 2 + (pos[i][1] - r[1]) ** 2
+        if best[0] is None or err < best[0]:
+            best = (err, lag)
+    return best[1]
+
+
+def path(pos, lo, hi):
+    return sum(abs(pos[i][0] - pos[i - 1][0]) + abs(pos[i][1] - pos[i - 1][1])
+               for i in range(lo + 1, hi))
+
+
+def smoothness(t, out, frame_us, gap_us):
+    """Coefficient of variation of the motion per frame, within strokes"""
+    frames = {}
+    for us, (dx, dy) in zip(t, out):
+        if dx or dy:
+            f = us // frame_us
+            x, y = frames.get(f, (0, 0))
+            frames[f] = (x + dx, y + dy)
+    cvs, stroke, last = [], [], None
+    for f in sorted(frames) + [None]:
+        if f is None or (last is not None and (f - last) * frame_us > gap_us):
+            if len(stroke) > 1:
+                # every frame of the stroke, including the empty ones
+                mags = [0.0] * (stroke[-1] - stroke[0] + 1)
+                for s in stroke:
+                    mags[s - stroke[0]] = (frames[s][0] ** 2 + frames[s][1] ** 2) ** 0.5
+                mean = statistics.mean(mags)
+                cvs.append(statistics.pstdev(mags) / mean)
+            stroke = []
+        if f is not None:
+            stroke.append(f)
+            last = f
+    return statistics.mean(cvs) if cvs else float("nan")
+
+
+def packet_period(t, inp):
+    pt = [us for us, m in zip(t, inp) if m != (0, 0)]
+    iv = [b - a for a, b in zip(pt, pt[1:]) if b - a < 50000]
+    return int(statistics.median(iv)) if iv else 12500
+
+
+def report_lag(t, inp, out):
+    ref = integrate(inp)
+    pos = integrate(out)
+    bins = {b: [] for b in SPEED_BINS + (None,)}
+    lo = 0
+    while lo < len(t) - 1:
+        hi = bisect.bisect_left(t, t[lo] + WINDOW_US, lo + 1)
+        if hi - lo >= 3:
+            dist = path(ref, lo, hi) / 256
+            speed = dist * 1e6 / max(t[hi - 1] - t[lo], 1)
+            key = next((b for b in SPEED_BINS if speed < b), None)
+            ratio = path(pos, lo, hi) / max(path(ref, lo, hi), 1)
+            bins[key].append((best_lag(t, ref, t, pos, lo, hi), ratio))
+        lo = hi
+
+    print("%-14s %8s %12s %12s %14s" % ("speed count/s", "windows", "lag med ms",
+                                        "lag max ms", "path out/in"))
+    prev = 0
+    for b in SPEED_BINS + (None,):
+        rows = bins[b]
+        name = "%d-%d" % (prev, b) if b else ">=%d" % prev
+        prev = b
+        if not rows:
+            continue
+        lags = [r[0] / 1000 for r in rows]
+        print("%-14s %8d %12.1f %12.1f %14.2f" % (name, len(rows), statistics.median(lags),
+                                                  max(lags),
+                                                  statistics.mean(r[1] for r in rows)))
+
+
+def load_pointer():
+    tmp = tempfile.mkdtemp()
+    lib = os.path.join(tmp, "libpointer.so")
+    subprocess.check_call(["cc", "-O2", "-shared", "-fPIC", "-o", lib, POINTER_C])
+    so = ctypes.CDLL(lib)
+    i32p = ctypes.POINTER(ctypes.c_int32)
+    so.pointer_resample_reset.argtypes = [ctypes.c_void_p]
+    so.pointer_resample_push.argtypes = [ctypes.c_void_p, ctypes.c_int32, ctypes.c_int32,
+                                         ctypes.c_int64, ctypes.c_int64]
+    so.pointer_resample_take.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.c_bool, i32p,
+                                         i32p]
+    so.pointer_resample_take.restype = ctypes.c_bool
+    return so
+
+
+def replay(so, t, inp, frame_us, period_us, mode):
+    """Output motion on each simulated frame: mode is packet, resample or extrapolate"""
+    state = ctypes.create_string_buffer(256)
+    so.pointer_resample_reset(state)
+    ox, oy = ctypes.c_int32(), ctypes.c_int32()
+    packets = [(us, m) for us, m in zip(t, inp) if m != (0, 0)]
+    ft, fout, i = [], [], 0
+    now = packets[0][0] // frame_us * frame_us
+    while i < len(packets) or now <= packets[-1][0] + 3 * period_us:
+        now += frame_us
+        x = y = 0
+        while i < len(packets) and packets[i][0] <= now:
+            us, (px, py) = packets[i]
+            if mode == "packet":
+                x += px
+                y += py
+            else:
+                so.pointer_resample_push(state, px, py, period_us, us)
+            i += 1
+        if mode != "packet":
+            so.pointer_resample_take(state, now, mode == "extrapolate", ctypes.byref(ox),
+                                     ctypes.byref(oy))
+            x, y = ox.value, oy.value
+        ft.append(now)
+        fout.append((x, y))
+    return ft, fout
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("trace", nargs="?", help="captured log, stdin if omitted")
+    ap.add_argument("--frame-ms", type=float, default=1.0, help="USB polling interval")
+    ap.add_argument("--replay", action="store_true",
+                    help="run the packets through the resampler on the host")
+    args = ap.parse_args()
+    frame_us = int(args.frame_ms * 1000)
+
+    with (open(args.trace, errors="replace") if args.trace else sys.stdin) as f:
+        t, inp, out = parse(f)
+    if len(t) < 2:
+        sys.exit("no TPM lines found, is TRACE_TRACKPOINT_MOTION defined?")
+    period_us = packet_period(t, inp)
+    gap_us = 3 * period_us
+
+    if not args.replay:
+        report_lag(t, inp, out)
+        print("\nsmoothness on %g ms frames: %.2f" % (args.frame_ms,
+                                                     smoothness(t, out, frame_us, gap_us)))
+        return
+
+    so = load_pointer()
+    ref_pos = integrate(inp)
+    total = (sum(m[0] for m in inp), sum(m[1] for m in inp))
+    print("packet period %.1f ms, %g ms frames" % (period_us / 1000, args.frame_ms))
+    print("%-12s %12s %12s %16s" % ("mode", "smoothness", "lag ms", "overshoot count"))
+    for mode in ("packet", "resample", "extrapolate"):
+        ft, fout = replay(so, t, inp, frame_us, period_us, mode)
+        pos = integrate(fout)
+        lag = best_lag(t, ref_pos, ft, pos, 0, len(ft))
+        over = (abs(pos[-1][0] - total[0]) + abs(pos[-1][1] - total[1])) / 256
+        print("%-12s %12.2f %12.1f %16.1f" % (mode, smoothness(ft, fout, frame_us, gap_us),
+                                             lag / 1000, over))
+
+
+if __name__ == "__main__":
+    main()
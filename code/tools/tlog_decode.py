@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""
+Render the tokenised log lines of the console, see src/tlog.h.
+
+Build with USE_TLOG defined in src/tlog.h, then feed the console through
+the script with the ELF of the same build:
+
+    pio device monitor | python3 tools/tlog_decode.py .pio/build/esp32-s3-devkitc-1/firmware.elf
+
+A line "@<format address>,<ms>,<argument>,..." is looked up in the .tlog_fmt
+section of the ELF and formatted like ESP_LOG would, with the file and line
+in place of the tag. The other lines are passed through as they are.
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+SECTION = ".tlog_fmt"
+
+RECORD = re.compile(r"@([0-9a-f]+),([0-9a-f]+)((?:,[^,\s]*)*)\s*$")
+CONVERSION = re.compile(r"%([-+ #0]*)(\d+|\*)?(?:\.(\d+|\*))?(hh|h|ll|l|j|z|t|L)?([diouxXeEfgGcsp%])")
+
+
+def read_section(path, name):
+    """Address and data of a section of an ELF32 little-endian file"""
+    with open(path, "rb") as f:
+        elf = f.read()
+    if elf[:4] != b"\x7fELF" or elf[4] != 1 or elf[5] != 1:
+        sys.exit("%s: not a 32-bit little-endian ELF" % path)
+    shoff, = struct.unpack_from("<I", elf, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2e)
+
+    def header(i):
+        # name, type, flags, addr, offset, size
+        return struct.unpack_from("<IIIIII", elf, shoff + i * shentsize)
+
+    strtab = header(shstrndx)
+    for i in range(shnum):
+        sh_name, _, _, addr, offset, size = header(i)
+        start = strtab[4] + sh_name
+        if elf[start:elf.index(b"\0", start)].decode() == name:
+            return addr, elf[offset:offset + size]
+    sys.exit("%s: no %s section, is USE_TLOG defined?" % (path, name))
+
+
+def signed(value, bits):
+    value &= (1 << bits) - 1
+    return value - (1 << bits) if value >> (bits - 1) else value
+
+
+def render(fmt, args):
+    """printf() on the host: the conversion tells how to read each argument"""
+    args = iter(args)
+
+    def convert(m):
+        flags, width, prec, length, conv = m.groups()
+        if conv == "%":
+            return "%"
+        arg = next(args, None)
+        if arg is None:
+            return "<?>"
+        # 64-bit arguments have more digits when negative, whatever %l means
+        bits = 64 if length in ("ll", "j") or len(arg) > 8 else 32
+        spec = "%" + flags + (width or "") + ("." + prec if prec else "")
+        if conv == "s":
+            return (spec + "s") % (bytes.fromhex(arg[1:]).decode(errors="replace")
+                                   if arg.startswith('"') else "<?>")
+        value = int(arg, 16) if arg and not arg.startswith('"') else 0
+        if conv in "di":
+            return (spec + "d") % signed(value, bits)
+        if conv in "ouxX":
+            return (spec + conv) % (value & ((1 << bits) - 1))
+        if conv in "eEfgG":
+            return (spec + conv) % struct.unpack("<d", struct.pack("<Q", value))[0]
+        if conv == "c":
+            return (spec + "c") % (value & 0xff)
+        return "0x%x" % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode(line, addr, data):
+    m = RECORD.search(line)
+    if not m:
+        return line
+    offset = int(m.group(1), 16) - addr
+    if offset < 0 or offset >= len(data):
+        return line
+    entry = data[offset:data.index(b"\0", offset)].decode(errors="replace")
+    level, where, fmt = entry.split("|", 2)
+    file, _, lineno = where.rpartition(":")
+    args = m.group(3).split(",")[1:]
+    text = render(fmt, args).rstrip("\n")
+    return "%s%s (%d) %s:%s: %s\n" % (line[:m.start()], level, int(m.group(2), 16),
+                                      os.path.basename(file), lineno, text)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("elf", help="firmware ELF of the build running")
+    ap.add_argument("log", nargs="?", help="captured console, stdin if omitted")
+    args = ap.parse_args()
+
+    addr, data = read_section(args.elf, SECTION)
+    with (open(args.log, errors="replace") if args.log else sys.stdin) as f:
+        for line in f:
+            sys.stdout.write(decode(line, addr, data))
+            sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()